@@ -109,7 +109,8 @@ int lm_keyreq(const ra_samp_request_header_t *p_msg,
     int data_size, msg2_size, recvlen;
 
     std::string srcStr;
-    srcStr = std::to_string(*((int*)p_msg));
+    // the body is the hashed identity of the requesting client
+    srcStr.assign((const char *) p_msg, msg_size);
     sha256(srcStr, encodedHexStr);
     ChronTreeT::Hash hash(encodedHexStr);
     logTree.append(hash, proofs);
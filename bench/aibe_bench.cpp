@@ -0,0 +1,247 @@
+//
+// Microbenchmarks of the AibeAlgo primitives, JSON on stdout. Needs PBC, GMP and OpenSSL only.
+//
+// usage: aibe_bench [param file] [iterations]
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <algorithm>
+#include <vector>
+
+#include "aibe.h"
+
+#define BENCH_ITER 100
+#define BENCH_RCPT 100
+// block_encrypt + block_decrypt rounds before the steady state allocation count, enough for the
+// free lists to hold every size class the round needs at once
+#define BENCH_WARMUP 3
+
+int bench_first = 1;
+// failed round trips and checks, the exit status
+int bench_failed = 0;
+
+// one JSON result: min / median / p99 of iter runs of fn, ops/s from the mean
+template<typename F>
+void bench_run(const char *name, int iter, F fn) {
+    std::vector<double> us(iter);
+    double sum = 0;
+
+    for (int i = 0; i < iter; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        std::chrono::duration<double, std::micro> d = std::chrono::steady_clock::now() - start;
+        us[i] = d.count();
+        sum += us[i];
+    }
+    std::sort(us.begin(), us.end());
+
+    printf("%s\n    {\"name\": \"%s\", \"iterations\": %d, \"min_us\": %.2f, \"median_us\": %.2f, "
+           "\"p99_us\": %.2f, \"ops_per_sec\": %.2f}", bench_first ? "" : ",", name, iter, us[0],
+           us[iter / 2], us[(iter * 99 + 99) / 100 - 1], iter * 1e6 / sum);
+    bench_first = 0;
+}
+
+// encrypt / decrypt of a len byte message in the given mode
+void bench_message(AibeAlgo *aibe, const aibe_id_t *id, int mode, int len, int iter) {
+    char name[64];
+    int ct_len;
+    int size = mode == AIBE_MODE_HYBRID ? aibe->hybrid_size(len) : aibe->block_ct_size(len);
+    char *str = (char *) malloc(len + 1);
+    uint8_t *ct = (uint8_t *) malloc(size);
+    uint8_t *msg = (uint8_t *) malloc(size + 1);
+    const char *mode_name = mode == AIBE_MODE_HYBRID ? "hybrid" : "block";
+
+    memset(str, 'a', len);
+    str[len] = '\0';
+    aibe->mode = mode;
+
+    snprintf(name, sizeof(name), "encrypt_%s_%d", mode_name, len);
+    bench_run(name, iter, [&]() { ct_len = aibe->encrypt(ct, str, id); });
+    snprintf(name, sizeof(name), "decrypt_%s_%d", mode_name, len);
+    bench_run(name, iter, [&]() { aibe->decrypt(msg, ct, ct_len); });
+    if (aibe->decrypt(msg, ct, ct_len) != len || memcmp(msg, str, len)) {
+        fprintf(stderr, "%s: round trip failed\n", name);
+        bench_failed++;
+    }
+
+    free(str);
+    free(ct);
+    free(msg);
+}
+
+int main(int argc, char *argv[]) {
+    const char *param = argc > 1 ? argv[1] : "../client/param/aibe.param";
+    int iter = argc > 2 ? atoi(argv[2]) : BENCH_ITER;
+    char dir[] = "/tmp/aibe_bench.XXXXXX";
+    AibeAlgo aibe;
+    aibe_id_t id;
+    const int sizes[] = {16, 1024, 65536, 1048576};
+    alloc_stats_t st0, st1;
+
+    alloc_install();
+    alloc_thread_begin();
+
+    if (iter <= 0 || aibe.load_param(param)) {
+        fprintf(stderr, "usage: %s [param file] [iterations]\n", argv[0]);
+        return -1;
+    }
+    aibe.init();
+    id_hash(&id, ID);
+    aibe.dk_id = id;
+    aibe.dk_id_set = 1;
+
+    // the key files go to a scratch directory, mpk_path and friends are relative
+    if (!mkdtemp(dir) || chdir(dir) || mkdir("param", 0700)) {
+        fprintf(stderr, "scratch directory failed\n");
+        return -1;
+    }
+    aibe.pkg_setup_generate();
+    aibe.mpk_load();
+    aibe.msk_load();
+    aibe.keygen1(&id);
+    aibe.keygen2();
+    if (aibe.keygen3()) {
+        fprintf(stderr, "key verify failed\n");
+        return -1;
+    }
+    aibe.dk_store();
+    aibe.dk_load();
+
+    // malloc calls of a warmed up block_encrypt + block_decrypt, expected 0
+    element_random(aibe.blk.m);
+    for (int i = 0; i < BENCH_WARMUP; ++i) {
+        aibe.block_encrypt(&aibe.blk, &id);
+        aibe.block_decrypt(&aibe.blk);
+    }
+    alloc_stats(&st0);
+    for (int i = 0; i < iter; ++i) {
+        aibe.block_encrypt(&aibe.blk, &id);
+        aibe.block_decrypt(&aibe.blk);
+    }
+    alloc_stats(&st1);
+    if (st1.heap != st0.heap) {
+        fprintf(stderr, "steady state block_encrypt + block_decrypt reached malloc %llu times\n",
+                (unsigned long long) (st1.heap - st0.heap));
+        bench_failed++;
+    }
+
+    printf("{\n  \"param\": \"%s\",\n  \"backend\": \"%s\",\n  \"workers\": %d,\n  \"task_threads\": %d,\n"
+           "  \"size_block\": %d,\n", param, aibe.backend.name, aibe.worker_num(), aibe.task_threads, aibe.size_block);
+    printf("  \"steady_heap_allocs\": %llu,\n  \"steady_arena_allocs\": %llu,\n  \"results\": [",
+           (unsigned long long) (st1.heap - st0.heap), (unsigned long long) (st1.calls - st0.calls));
+
+    element_random(aibe.mp1[0]);
+    element_random(aibe.mp2[0]);
+    bench_run("pairing", iter, [&]() { aibe.pairing_prod(aibe.el, aibe.mp1, aibe.mp2, 1, 0); });
+    bench_run("hz_compute", iter, [&]() { aibe.hz_compute(aibe.blk.Hz, &id); });
+    bench_run("keygen1", iter, [&]() { aibe.keygen1(&id); });
+    bench_run("keygen2", iter, [&]() { aibe.keygen2(); });
+    bench_run("keygen3", iter, [&]() { aibe.keygen3(); });
+    {
+        // STREAM_BATCH requests per call, all for the current (R, Hz)
+        element_t Rs[STREAM_BATCH], hzs[STREAM_BATCH];
+        dk_t dks[STREAM_BATCH];
+        for (int i = 0; i < STREAM_BATCH; ++i) {
+            element_init_same_as(Rs[i], aibe.R);
+            element_set(Rs[i], aibe.R);
+            element_init_same_as(hzs[i], aibe.Hz);
+            element_set(hzs[i], aibe.Hz);
+            dk_init(&dks[i], aibe.pairing);
+        }
+        bench_run("keygen2_batch", iter, [&]() { aibe.keygen2_batch(Rs, hzs, STREAM_BATCH, dks); });
+        for (int i = 0; i < STREAM_BATCH; ++i) {
+            element_clear(Rs[i]);
+            element_clear(hzs[i]);
+            dk_clear(&dks[i]);
+        }
+    }
+    // keygen3 replaced dk, read back the stored one
+    bench_run("dk_load", iter, [&]() { aibe.dk_load(); });
+    bench_run("mpk_load", iter, [&]() { aibe.mpk_load(); });
+
+    element_random(aibe.blk.m);
+    bench_run("block_encrypt", iter, [&]() { aibe.block_encrypt(&aibe.blk, &id); });
+    bench_run("block_decrypt", iter, [&]() { aibe.block_decrypt(&aibe.blk); });
+
+    // online part only: a full offline pool covers every iteration
+    aibe.enc_pool_cap = iter;
+    aibe.pools_start();
+    for (int ready = 0; !ready; usleep(1000)) {
+        std::lock_guard<std::mutex> lock(aibe.enc_pool->mtx);
+        ready = aibe.enc_pool->count == iter;
+    }
+    bench_run("block_encrypt_online", iter, [&]() { aibe.block_encrypt(&aibe.blk, &id); });
+    aibe.enc_pool_cap = 0;
+    aibe.pools_stop();
+    {
+        uint8_t buf[1024];
+        bench_run("ct_store", iter, [&]() { aibe.ct_store(&aibe.blk, buf); });
+        bench_run("ct_load", iter, [&]() { aibe.ct_load(&aibe.blk, buf); });
+    }
+
+    {
+        // BENCH_RCPT recipients, id among them
+        std::vector<aibe_id_t> ids(BENCH_RCPT);
+        char str[32];
+        int len = 1024, ct_len = 0;
+        uint8_t msg[1025], data[1024];
+        std::vector<uint8_t> ct(aibe.bcast_size(len, BENCH_RCPT));
+        for (int i = 1; i < BENCH_RCPT; ++i) {
+            snprintf(str, sizeof(str), "user%d@aibe", i);
+            id_hash(&ids[i], str);
+        }
+        ids[0] = id;
+        memset(data, 'a', len);
+        bench_run("encrypt_bcast_1024", iter, [&]() {
+            ct_len = aibe.encrypt_bcast(ct.data(), data, len, ids.data(), BENCH_RCPT);
+        });
+        bench_run("decrypt_bcast_1024", iter, [&]() { aibe.decrypt_bcast(msg, ct.data(), ct_len, &id); });
+        if (aibe.decrypt_bcast(msg, ct.data(), ct_len, &id) != len || memcmp(msg, data, len)) {
+            fprintf(stderr, "decrypt_bcast_1024: round trip failed\n");
+            bench_failed++;
+        }
+    }
+    for (int i = 0; i < 2; ++i) {
+        bench_message(&aibe, &id, AIBE_MODE_BLOCK, sizes[i], iter);
+    }
+    for (int i = 0; i < 4; ++i) {
+        bench_message(&aibe, &id, AIBE_MODE_HYBRID, sizes[i], iter);
+    }
+    printf("\n  ]\n}\n");
+    if (AIBE_STATS) {
+        // whole run, all of the above
+        aibe_stats_t st;
+        aibe_stats(&st);
+        aibe_stats_print(stderr, &st);
+        // every run above pairs, exponentiates and draws randoms, and times each op
+        const int counted[] = {STAT_PAIRING, STAT_POW_G1, STAT_RANDOM};
+        for (int k : counted) {
+            if (!st.count[k]) {
+                fprintf(stderr, "stats: no %s counted\n", stat_names[k]);
+                bench_failed++;
+            }
+        }
+        for (int op = 0; op < OP_NUM; ++op) {
+            if (!st.calls[op]) {
+                fprintf(stderr, "stats: no %s calls counted\n", op_names[op]);
+                bench_failed++;
+            }
+        }
+    }
+
+    unlink(mpk_path);
+    unlink(msk_path);
+    unlink(dk_path);
+    rmdir("param");
+    if (chdir("/") == 0)
+        rmdir(dir);
+    aibe.clear();
+    alloc_thread_end();
+    return bench_failed ? 1 : 0;
+}
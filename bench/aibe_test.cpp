@@ -0,0 +1,969 @@
+//
+// Round trip and rejection checks of the AibeAlgo ciphertext formats. Needs PBC, GMP and OpenSSL
+// only; exits non-zero if any check fails.
+//
+// usage: aibe_test [param file]
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "aibe.h"
+
+int test_failed = 0;
+
+// mode bytes no encoder writes: unknown modes, a block header without flags, flags of another mode
+const int bad_flags[] = {3, AIBE_MODE_MASK, AIBE_MODE_BLOCK, AIBE_MODE_HYBRID | AIBE_FMT_AUTH,
+                         AIBE_MODE_HYBRID | AIBE_FMT_LEN, AIBE_MODE_BCAST | AIBE_FMT_AUTH};
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fputc('\n', stderr); \
+        test_failed++; \
+    } \
+} while (0)
+
+// len bytes of binary data ending in zero bytes, the padding of the last block must not eat them
+std::vector<uint8_t> test_data(int len) {
+    std::vector<uint8_t> data(len);
+
+    for (int i = 0; i < len; ++i) {
+        data[i] = (uint8_t) (i * 131 + 7);
+    }
+    for (int i = std::max(len - 3, 0); i < len; ++i) {
+        data[i] = 0;
+    }
+    return data;
+}
+
+std::vector<uint8_t> file_read(FILE *f) {
+    std::vector<uint8_t> data;
+    int c;
+
+    rewind(f);
+    while ((c = fgetc(f)) != EOF) {
+        data.push_back((uint8_t) c);
+    }
+    return data;
+}
+
+void file_write(FILE *f, const std::vector<uint8_t> &data) {
+    rewind(f);
+    if (ftruncate(fileno(f), 0) || (data.size() && fwrite(data.data(), data.size(), 1, f) != 1))
+        abort();
+    fflush(f);
+    rewind(f);
+}
+
+// encrypt_stream() or encrypt_container() of data, the ciphertext is left in ct
+int64_t stream_seal(AibeAlgo *aibe, const aibe_id_t *id, const std::vector<uint8_t> &data, FILE *ct, int cont) {
+    FILE *in = tmpfile();
+    int64_t n;
+
+    file_write(in, data);
+    rewind(ct);
+    if (ftruncate(fileno(ct), 0))
+        abort();
+    n = cont ? aibe->encrypt_container(in, ct, id) : aibe->encrypt_stream(in, ct, id);
+    fflush(ct);
+    rewind(ct);
+    fclose(in);
+    return n;
+}
+
+// decrypt_stream() of ct into out, -1 on rejection
+int64_t stream_open(AibeAlgo *aibe, FILE *ct, std::vector<uint8_t> *out) {
+    FILE *f = tmpfile();
+    int64_t n;
+
+    rewind(ct);
+    n = aibe->decrypt_stream(ct, f);
+    *out = file_read(f);
+    fclose(f);
+    return n;
+}
+
+void test_streams(AibeAlgo *aibe, const aibe_id_t *id) {
+    const int lens[] = {0, 1, 127, 128, 129, 1000, DEM_CHUNK, DEM_CHUNK + 1, 2 * DEM_CHUNK + 5};
+    const char *mode_name[] = {"block", "hybrid"};
+    FILE *ct = tmpfile();
+    std::vector<uint8_t> out;
+
+    for (int mode = AIBE_MODE_BLOCK; mode <= AIBE_MODE_HYBRID; ++mode) {
+        for (int cont = 0; cont < 2; ++cont) {
+            for (int len : lens) {
+                std::vector<uint8_t> data = test_data(len);
+                aibe->mode = mode;
+                int64_t n = stream_seal(aibe, id, data, ct, cont);
+                CHECK(n > 0, "%s %s %d: encrypt failed", mode_name[mode], cont ? "container" : "stream", len);
+                n = stream_open(aibe, ct, &out);
+                CHECK(n == len && out == data, "%s %s %d: round trip failed (%lld)", mode_name[mode],
+                      cont ? "container" : "stream", len, (long long) n);
+            }
+        }
+
+        // one flipped byte in the header, the first unit and the last byte of the stream
+        std::vector<uint8_t> data = test_data(3000);
+        aibe->mode = mode;
+        stream_seal(aibe, id, data, ct, 0);
+        std::vector<uint8_t> good = file_read(ct);
+        const size_t pos[] = {sizeof(aibe_magic) + 3, (size_t) aibe->size_hyb_header + 10, good.size() - 1};
+        for (size_t p : pos) {
+            std::vector<uint8_t> bad = good;
+            bad[p] ^= 0x01;
+            file_write(ct, bad);
+            int64_t n = stream_open(aibe, ct, &out);
+            CHECK(n < 0 || out != data, "%s stream: byte %zu flipped, still accepted", mode_name[mode], p);
+        }
+        // a truncated stream
+        std::vector<uint8_t> bad(good.begin(), good.end() - 1);
+        file_write(ct, bad);
+        CHECK(stream_open(aibe, ct, &out) < 0, "%s stream: truncated, still accepted", mode_name[mode]);
+        for (int f : bad_flags) {
+            bad = good;
+            bad[sizeof(aibe_magic)] = (uint8_t) f;
+            file_write(ct, bad);
+            CHECK(stream_open(aibe, ct, &out) < 0, "%s stream: mode byte 0x%02x accepted", mode_name[mode], f);
+        }
+
+        // a container of another param file, and one with its length field off by one
+        stream_seal(aibe, id, data, ct, 1);
+        good = file_read(ct);
+        const size_t cpos[] = {8, 8 + SHA256_DIGEST_LENGTH + ID_BYTES + 15};
+        for (size_t p : cpos) {
+            bad = good;
+            bad[p] ^= 0x01;
+            file_write(ct, bad);
+            CHECK(stream_open(aibe, ct, &out) < 0, "%s container: byte %zu flipped, still accepted",
+                  mode_name[mode], p);
+        }
+    }
+    fclose(ct);
+}
+
+// cont_decrypt() of single units in reverse order, a middle range and the tail, straight from the
+// mapping, against the plaintext; out-of-range requests and a damaged chunk of a hybrid container
+void test_cont_random(AibeAlgo *aibe, const aibe_id_t *id) {
+    FILE *ct = tmpfile();
+
+    for (int mode = AIBE_MODE_BLOCK; mode <= AIBE_MODE_HYBRID; ++mode) {
+        std::vector<uint8_t> data = test_data(mode == AIBE_MODE_HYBRID ? 3 * DEM_CHUNK + 17 : 1000);
+        aibe_cont_t c;
+
+        aibe->mode = mode;
+        stream_seal(aibe, id, data, ct, 1);
+        CHECK(!cont_open(&c, fileno(ct)) && !aibe->cont_attach(&c), "mode %d: container not attached", mode);
+        if (!c.base)
+            continue;
+        std::vector<uint8_t> out((size_t) c.count * c.unit_plain);
+        uint64_t unit = c.unit_plain;
+
+        CHECK(c.count == (data.size() + unit - 1) / unit, "mode %d: %llu units", mode, (unsigned long long) c.count);
+        for (uint64_t i = c.count; i-- > 0;) {
+            int64_t n = aibe->cont_decrypt(&c, i, 1, out.data());
+            uint64_t want = std::min<uint64_t>(unit, data.size() - i * unit);
+            CHECK(n == (int64_t) want && !memcmp(out.data(), data.data() + i * unit, want),
+                  "mode %d: unit %llu of %llu failed", mode, (unsigned long long) i, (unsigned long long) c.count);
+        }
+        if (c.count > 2) {
+            int64_t n = aibe->cont_decrypt(&c, 1, c.count - 2, out.data());
+            CHECK(n == (int64_t) ((c.count - 2) * unit) && !memcmp(out.data(), data.data() + unit, n),
+                  "mode %d: middle range failed", mode);
+        }
+        CHECK(aibe->cont_decrypt(&c, c.count, 0, out.data()) == 0, "mode %d: empty tail range failed", mode);
+        CHECK(aibe->cont_decrypt(&c, c.count + 1, 0, out.data()) < 0, "mode %d: first past the end accepted", mode);
+        CHECK(aibe->cont_decrypt(&c, 1, c.count, out.data()) < 0, "mode %d: range past the end accepted", mode);
+        cont_close(&c);
+
+        if (mode != AIBE_MODE_HYBRID)
+            continue;
+        // a damaged second chunk fails alone, the others still open
+        std::vector<uint8_t> bad = file_read(ct);
+        CHECK(!cont_open(&c, fileno(ct)) && !aibe->cont_attach(&c), "damaged: container not attached");
+        if (!c.base)
+            continue;
+        bad[cont_off(&c, 1) + 10] ^= 0x01;
+        cont_close(&c);
+        file_write(ct, bad);
+        CHECK(!cont_open(&c, fileno(ct)) && !aibe->cont_attach(&c), "damaged: container not attached");
+        if (!c.base)
+            continue;
+        CHECK(aibe->cont_decrypt(&c, 1, 1, out.data()) < 0, "damaged: chunk 1 accepted");
+        CHECK(aibe->cont_decrypt(&c, 0, 3, out.data()) < 0, "damaged: range over chunk 1 accepted");
+        CHECK(aibe->cont_decrypt(&c, 2, 1, out.data()) == (int64_t) unit
+              && !memcmp(out.data(), data.data() + 2 * unit, unit), "damaged: chunk 2 failed");
+        cont_close(&c);
+    }
+    fclose(ct);
+}
+
+// Authenticated block streams: round trips through decrypt_stream(), decrypt() and containers with
+// block_auth on and off. A flipped byte in the identity, the fingerprint, the first block, a block
+// of a later batch, the length or the tag fails the stream, decrypt() and cont_attach(); with
+// require_auth so do streams and containers without the tag, and a stream stripped of it.
+void test_auth_streams(AibeAlgo *aibe, const aibe_id_t *id) {
+    FILE *ct = tmpfile();
+    std::vector<uint8_t> out;
+    int batch = STREAM_BATCH * aibe->worker_num();
+    int lens[] = {0, 1000, 2 * batch * aibe->size_GT + 5};
+    aibe_cont_t c;
+
+    aibe->mode = AIBE_MODE_BLOCK;
+    for (int auth = 0; auth < 2; ++auth) {
+        aibe->block_auth = auth;
+        for (int len : lens) {
+            std::vector<uint8_t> data = test_data(len);
+            for (int cont = 0; cont < 2; ++cont) {
+                CHECK(stream_seal(aibe, id, data, ct, cont) > 0, "auth %d %d: encrypt failed", auth, len);
+                int64_t n = stream_open(aibe, ct, &out);
+                CHECK(n == len && out == data, "auth %d %d %s: round trip failed", auth, len,
+                      cont ? "container" : "stream");
+            }
+            stream_seal(aibe, id, data, ct, 0);
+            std::vector<uint8_t> good = file_read(ct);
+            CHECK(!(good[sizeof(aibe_magic)] & AIBE_FMT_AUTH) == !auth, "auth %d: mode byte 0x%02x", auth,
+                  good[sizeof(aibe_magic)]);
+            std::vector<uint8_t> msg(good.size() + 1);
+            CHECK(aibe->decrypt(msg.data(), good.data(), good.size()) == len && !memcmp(msg.data(), data.data(), len),
+                  "auth %d %d: decrypt of the stream failed", auth, len);
+        }
+    }
+
+    std::vector<uint8_t> data = test_data(lens[2]);
+    stream_seal(aibe, id, data, ct, 0);
+    std::vector<uint8_t> good = file_read(ct);
+    std::vector<uint8_t> msg(good.size() + 1);
+    const size_t pos[] = {sizeof(aibe_magic) + 1, AUTH_STREAM_HEADER_SIZE - 1, AUTH_STREAM_HEADER_SIZE + 10,
+                          good.size() - STREAM_LEN_SIZE - AUTH_TAG_SIZE - 10, good.size() - AUTH_TAG_SIZE - 1,
+                          good.size() - 1};
+    for (size_t p : pos) {
+        std::vector<uint8_t> bad = good;
+        bad[p] ^= 0x01;
+        file_write(ct, bad);
+        CHECK(stream_open(aibe, ct, &out) < 0, "auth stream: byte %zu flipped, still accepted", p);
+        CHECK(aibe->decrypt(msg.data(), bad.data(), bad.size()) < 0, "auth decrypt: byte %zu flipped, still accepted", p);
+    }
+
+    // the same bytes in a container, the first of its payload and a block of the last batch
+    stream_seal(aibe, id, data, ct, 1);
+    good = file_read(ct);
+    for (size_t p : {(size_t) CONT_HEADER_SIZE + AUTH_STREAM_HEADER_SIZE + 10, good.size() - AUTH_TAG_SIZE - 100}) {
+        std::vector<uint8_t> bad = good;
+        bad[p] ^= 0x01;
+        file_write(ct, bad);
+        CHECK(cont_open(&c, fileno(ct)) || aibe->cont_attach(&c), "auth container: byte %zu flipped, still attached", p);
+        cont_close(&c);
+        CHECK(stream_open(aibe, ct, &out) < 0, "auth container: byte %zu flipped, still accepted", p);
+    }
+
+    // require_auth: the tagged stream and container pass, a stream stripped of the flag and the
+    // untagged formats do not
+    aibe->require_auth = 1;
+    stream_seal(aibe, id, data, ct, 0);
+    good = file_read(ct);
+    CHECK(stream_open(aibe, ct, &out) == (int64_t) data.size() && out == data, "require_auth: stream rejected");
+    std::vector<uint8_t> bad = good;
+    bad[sizeof(aibe_magic)] &= ~AIBE_FMT_AUTH;
+    file_write(ct, bad);
+    CHECK(stream_open(aibe, ct, &out) < 0, "require_auth: stream without the AUTH flag accepted");
+    stream_seal(aibe, id, data, ct, 1);
+    CHECK(stream_open(aibe, ct, &out) == (int64_t) data.size() && out == data, "require_auth: container rejected");
+    aibe->block_auth = 0;
+    for (int cont = 0; cont < 2; ++cont) {
+        stream_seal(aibe, id, data, ct, cont);
+        CHECK(stream_open(aibe, ct, &out) < 0, "require_auth: untagged %s accepted", cont ? "container" : "stream");
+    }
+    aibe->block_auth = AIBE_BLOCK_AUTH;
+    aibe->require_auth = AIBE_REQUIRE_AUTH;
+    fclose(ct);
+}
+
+// block_encrypt() of a random m and block_decrypt() with the loaded dk, 0 if m comes back
+int block_round_trip(AibeAlgo *aibe, const aibe_id_t *id) {
+    element_t m;
+    int ret;
+
+    element_init_GT(m, aibe->pairing);
+    element_random(aibe->blk.m);
+    element_set(m, aibe->blk.m);
+    aibe->block_encrypt(&aibe->blk, id);
+    element_random(aibe->blk.m);
+    aibe->block_decrypt(&aibe->blk);
+    ret = element_cmp(m, aibe->blk.m) ? -1 : 0;
+    element_clear(m);
+    return ret;
+}
+
+// the dk pairing preprocessing follows AIBE_DK_PP, not the fixed-base switch
+void test_dk_pp(AibeAlgo *aibe, const aibe_id_t *id) {
+    aibe->fixed_base = 0;
+    aibe->dk_pp_init();
+    CHECK(aibe->dk_pp, "dk_pp_init: no preprocessing without fixed-base tables");
+    CHECK(!block_round_trip(aibe, id), "dk pp: block round trip failed");
+    aibe->dk_pp_use = 0;
+    aibe->dk_pp_init();
+    CHECK(!aibe->dk_pp, "dk_pp_init: preprocessing though disabled");
+    CHECK(!block_round_trip(aibe, id), "no dk pp: block round trip failed");
+    aibe->fixed_base = AIBE_FIXED_BASE;
+    aibe->dk_pp_use = AIBE_DK_PP;
+    aibe->dk_pp_init();
+}
+
+// Batch verification of BV_KEYS derived keys with d1 of one and d2 of another corrupted: the exact
+// bad indices, from memory and from stored files, and dk_load() of a bad key.
+#define BV_KEYS 7
+
+void test_dk_verify(AibeAlgo *aibe, const aibe_id_t *id) {
+    dk_t dks[BV_KEYS];
+    element_t hzs[BV_KEYS];
+    aibe_id_t ids[BV_KEYS];
+    char names[BV_KEYS][32];
+    const char *paths[BV_KEYS];
+    int bad[BV_KEYS];
+    const int bad1 = 2, bad2 = 5;
+
+    // the stored key of id, dk_store() below writes over dk_path
+    CHECK(!rename(dk_path, "param/dk.keep"), "dk_verify: rename of %s failed", dk_path);
+    for (int i = 0; i < BV_KEYS; ++i) {
+        char str[32];
+        snprintf(str, sizeof(str), "user%d@aibe", i);
+        id_hash(&ids[i], str);
+        dk_init(&dks[i], aibe->pairing);
+        element_init_G1(hzs[i], aibe->pairing);
+        aibe->keygen1(&ids[i]);
+        aibe->keygen2();
+        CHECK(!aibe->keygen3(), "dk_verify: keygen3 of key %d failed", i);
+        element_set(dks[i].d1, aibe->dk.d1);
+        element_set(dks[i].d2, aibe->dk.d2);
+        element_set(dks[i].d3, aibe->dk.d3);
+        aibe->hz_compute(hzs[i], &ids[i]);
+    }
+    CHECK(aibe->dk_verify_batch(dks, hzs, BV_KEYS, bad) == 0, "dk_verify_batch: good keys rejected");
+
+    element_random(dks[bad1].d1);
+    element_random(dks[bad2].d2);
+    CHECK(aibe->dk_verify_batch(dks, hzs, BV_KEYS, bad) == 2, "dk_verify_batch: not 2 bad keys");
+    for (int i = 0; i < BV_KEYS; ++i) {
+        CHECK(bad[i] == (i == bad1 || i == bad2), "dk_verify_batch: bad[%d] = %d", i, bad[i]);
+    }
+
+    // the same keys through dk_store() files, one of them missing
+    for (int i = 0; i < BV_KEYS; ++i) {
+        snprintf(names[i], sizeof(names[i]), "param/dk%d.out", i);
+        paths[i] = names[i];
+        element_set(aibe->dk.d1, dks[i].d1);
+        element_set(aibe->dk.d2, dks[i].d2);
+        element_set(aibe->dk.d3, dks[i].d3);
+        aibe->dk_store();
+        CHECK(!rename(dk_path, names[i]), "dk_verify: rename to %s failed", names[i]);
+    }
+    unlink(names[0]);
+    CHECK(aibe->dk_verify_files(paths, ids, BV_KEYS, bad) == 3, "dk_verify_files: not 3 bad keys");
+    for (int i = 0; i < BV_KEYS; ++i) {
+        CHECK(bad[i] == (i == 0 || i == bad1 || i == bad2), "dk_verify_files: bad[%d] = %d", i, bad[i]);
+        unlink(names[i]);
+    }
+
+    for (int i = 0; i < BV_KEYS; ++i) {
+        dk_clear(&dks[i]);
+        element_clear(hzs[i]);
+    }
+
+    // dk_load() of a key that is not the one of dk_id fails, the stored key of id loads
+    CHECK(!rename("param/dk.keep", dk_path), "dk_verify: rename to %s failed", dk_path);
+    aibe->dk_id = ids[1];
+    CHECK(aibe->dk_load(), "dk_load: key of another identity accepted");
+    aibe->dk_id = *id;
+    CHECK(!aibe->dk_load(), "dk_load: stored key rejected");
+}
+
+// waits up to 10 s for the pool to hold n tuples, 0 once it does
+int pool_wait(pool_t *pool, int n) {
+    for (int i = 0; i < 10000; ++i) {
+        {
+            std::lock_guard<std::mutex> lock(pool->mtx);
+            if (pool->count >= n)
+                return 0;
+        }
+        usleep(1000);
+    }
+    return -1;
+}
+
+// block_encrypt() from a full enc_pool and past it: every block decrypts, no tuple is used twice
+void test_enc_pool(AibeAlgo *aibe, const aibe_id_t *id) {
+    const int cap = 4, rounds = 3 * cap;
+    std::vector<std::vector<uint8_t>> c1s;
+    uint8_t buf[ELEM_MAX];
+
+    aibe->enc_pool_cap = cap;
+    aibe->pools_start();
+    CHECK(aibe->enc_pool && !pool_wait(aibe->enc_pool, cap), "enc_pool: not filled");
+    for (int i = 0; i < rounds && aibe->enc_pool; ++i) {
+        CHECK(!block_round_trip(aibe, id), "enc_pool: block %d round trip failed", i);
+        element_to_bytes(buf, aibe->blk.ct.c1);
+        c1s.emplace_back(buf, buf + element_length_in_bytes(aibe->blk.ct.c1));
+    }
+    for (size_t i = 0; i < c1s.size(); ++i) {
+        for (size_t j = 0; j < i; ++j) {
+            CHECK(c1s[i] != c1s[j], "enc_pool: blocks %zu and %zu share s", j, i);
+        }
+    }
+    if (aibe->enc_pool)
+        CHECK(aibe->enc_pool->hits >= (uint64_t) cap, "enc_pool: %llu hits", (unsigned long long) aibe->enc_pool->hits);
+
+    // whole messages from the pool
+    std::vector<char> str(1000, 'p');
+    str.push_back('\0');
+    aibe->mode = AIBE_MODE_BLOCK;
+    std::vector<uint8_t> ct(aibe->block_ct_size(1000)), msg(ct.size() + 1);
+    int n = aibe->encrypt(ct.data(), str.data(), id);
+    CHECK(aibe->decrypt(msg.data(), ct.data(), n) == 1000 && !memcmp(msg.data(), str.data(), 1000),
+          "enc_pool: message round trip failed");
+
+    aibe->enc_pool_cap = 0;
+    aibe->pools_stop();
+}
+
+// keygen1 / keygen2 from full kg1 and kg2 pools and past them: every key verifies in keygen3 and
+// decrypts, and no R or d2 repeats
+void test_kg_pools(AibeAlgo *aibe, const aibe_id_t *id) {
+    const int cap = 3, rounds = 3 * cap;
+    std::vector<std::vector<uint8_t>> rs, d2s;
+    uint8_t buf[ELEM_MAX];
+
+    aibe->kg1_pool_cap = aibe->kg2_pool_cap = cap;
+    aibe->pools_start();
+    CHECK(aibe->kg1_pool && !pool_wait(aibe->kg1_pool, cap), "kg1_pool: not filled");
+    CHECK(aibe->kg2_pool && !pool_wait(aibe->kg2_pool, cap), "kg2_pool: not filled");
+    for (int i = 0; i < rounds; ++i) {
+        aibe->keygen1(id);
+        element_to_bytes(buf, aibe->R);
+        rs.emplace_back(buf, buf + element_length_in_bytes(aibe->R));
+        aibe->keygen2();
+        element_to_bytes(buf, aibe->dk1.d2);
+        d2s.emplace_back(buf, buf + element_length_in_bytes(aibe->dk1.d2));
+        CHECK(!aibe->keygen3(), "kg pools: key %d does not verify", i);
+        aibe->dk_pp_init();
+        CHECK(!block_round_trip(aibe, id), "kg pools: key %d does not decrypt", i);
+    }
+    for (int i = 0; i < rounds; ++i) {
+        for (int j = 0; j < i; ++j) {
+            CHECK(rs[i] != rs[j] && d2s[i] != d2s[j], "kg pools: keys %d and %d share randomness", j, i);
+        }
+    }
+    if (aibe->kg1_pool && aibe->kg2_pool)
+        CHECK(aibe->kg1_pool->hits >= (uint64_t) cap && aibe->kg2_pool->hits >= (uint64_t) cap,
+              "kg pools: %llu / %llu hits", (unsigned long long) aibe->kg1_pool->hits,
+              (unsigned long long) aibe->kg2_pool->hits);
+
+    aibe->kg1_pool_cap = aibe->kg2_pool_cap = 0;
+    aibe->pools_stop();
+    CHECK(!aibe->dk_load(), "kg pools: stored key rejected");
+}
+
+std::vector<uint8_t> path_read(const char *path) {
+    FILE *f = fopen(path, "rb");
+    std::vector<uint8_t> data;
+
+    if (f) {
+        data = file_read(f);
+        fclose(f);
+    }
+    return data;
+}
+
+void path_write(const char *path, const std::vector<uint8_t> &data) {
+    FILE *f = fopen(path, "wb");
+
+    if (!f || (data.size() && fwrite(data.data(), data.size(), 1, f) != 1) || fclose(f))
+        abort();
+}
+
+// replaces the trailing SHA-256 of a bundle with the one of its edited content
+void bundle_rehash(std::vector<uint8_t> *b) {
+    b->resize(b->size() - SHA256_DIGEST_LENGTH);
+    b->resize(b->size() + SHA256_DIGEST_LENGTH);
+    SHA256(b->data(), b->size() - SHA256_DIGEST_LENGTH, b->data() + b->size() - SHA256_DIGEST_LENGTH);
+}
+
+// AibeAlgo of param with fresh in-memory master keys and the key of id derived from them
+void fresh_keys(AibeAlgo *a, const char *param, const aibe_id_t *id) {
+    a->load_param(param);
+    a->init();
+    a->setup();
+    a->mpk_precompute();
+    a->keygen1(id);
+    a->keygen2();
+    a->keygen3();
+}
+
+// Key bundle: store, load into a fresh instance and use it both ways; damaged, truncated,
+// mis-sized and foreign bundles must fail and leave the keys of aibe as they were, including one
+// that is only rejected by the dk check after it was swapped in.
+void test_bundle(AibeAlgo *aibe, const aibe_id_t *id, const char *param, const char *other) {
+    const char *path = "param/test.bundle", *bad_path = "param/bad.bundle";
+    const int all = BUNDLE_MSK | BUNDLE_DK | BUNDLE_TABLES;
+    std::vector<char> str(1000, 'b');
+    str.push_back('\0');
+    uint8_t x1[ELEM_MAX], x2[ELEM_MAX];
+
+    aibe->mode = AIBE_MODE_HYBRID;
+    std::vector<uint8_t> ct(aibe->hybrid_size(1000)), ct2(ct.size()), msg(ct.size() + 1);
+    int n = aibe->encrypt(ct.data(), str.data(), id);
+    CHECK(!aibe->bundle_store(path, all), "bundle_store failed");
+
+    {
+        AibeAlgo b;
+        b.load_param(param);
+        b.init();
+        b.dk_id = *id;
+        b.dk_id_set = 1;
+        CHECK(!b.bundle_load(path, BUNDLE_MSK | BUNDLE_DK), "bundle_load failed");
+        CHECK(!b.fixed_base || (b.fb_g.tab && b.hz_tab.tab), "bundle_load: no tables");
+        CHECK(b.decrypt(msg.data(), ct.data(), n) == 1000 && !memcmp(msg.data(), str.data(), 1000),
+              "bundle: ciphertext of the stored keys not decrypted");
+        b.mode = AIBE_MODE_HYBRID;
+        int n2 = b.encrypt(ct2.data(), str.data(), id);
+        CHECK(aibe->decrypt(msg.data(), ct2.data(), n2) == 1000 && !memcmp(msg.data(), str.data(), 1000),
+              "bundle: ciphertext of the loaded keys not decrypted");
+        b.keygen1(id);
+        b.keygen2();
+        CHECK(!b.keygen3(), "bundle: key from the loaded msk does not verify");
+        b.clear();
+    }
+
+    std::vector<uint8_t> good = path_read(path), bad;
+    std::vector<std::pair<std::vector<uint8_t>, const char *>> cases;
+    element_to_bytes(x1, aibe->mpk.X);
+
+    bad = good;
+    bad.pop_back();
+    cases.emplace_back(bad, "truncated by one byte");
+    bad.assign(good.begin(), good.begin() + good.size() / 2);
+    cases.emplace_back(bad, "truncated to half");
+    bundle_rehash(&bad);
+    cases.emplace_back(bad, "truncated to half, rehashed");
+    bad = good;
+    bad[good.size() / 2] ^= 0x01;
+    cases.emplace_back(bad, "byte flipped");
+    bad = good;
+    bad.insert(bad.end() - SHA256_DIGEST_LENGTH, 0);
+    bundle_rehash(&bad);
+    cases.emplace_back(bad, "trailing byte, rehashed");
+
+    // window and row count of the first table, rehashed so only the dimension check can fail
+    size_t tab = 8 + SHA256_DIGEST_LENGTH + 8 + aibe->param_len
+                 + (4 + z_size + 2) * element_length_in_bytes(aibe->g) + 2 * element_length_in_bytes(aibe->egh)
+                 + 2 * element_length_in_bytes(aibe->x);
+    if (aibe->fb_g.tab) {
+        CHECK(good[tab] == FB_WINDOW, "bundle: first table not at %zu", tab);
+        bad = good;
+        bad[tab]++;
+        bundle_rehash(&bad);
+        cases.emplace_back(bad, "table window");
+        bad = good;
+        bad[tab + 4]--;
+        bundle_rehash(&bad);
+        cases.emplace_back(bad, "table rows");
+    }
+
+    for (auto &c : cases) {
+        path_write(bad_path, c.first);
+        CHECK(aibe->bundle_load(bad_path, 0) < 0, "bundle: %s, accepted", c.second);
+    }
+
+    // a bundle without the msk, and the key of another identity under other master keys
+    {
+        AibeAlgo b;
+        aibe_id_t other_id;
+        id_hash(&other_id, "other@aibe");
+        fresh_keys(&b, param, &other_id);
+        CHECK(!b.bundle_store(bad_path, BUNDLE_DK | BUNDLE_TABLES), "bundle_store of other keys failed");
+        CHECK(aibe->bundle_load(bad_path, BUNDLE_MSK) < 0, "bundle: missing msk, accepted");
+        CHECK(aibe->bundle_load(bad_path, BUNDLE_DK) < 0, "bundle: dk of another identity, accepted");
+        b.clear();
+    }
+    // another profile
+    {
+        AibeAlgo b;
+        fresh_keys(&b, other, id);
+        CHECK(!b.bundle_store(bad_path, BUNDLE_DK | BUNDLE_TABLES), "bundle_store under %s failed", other);
+        CHECK(aibe->bundle_load(bad_path, 0) < 0, "bundle: made under %s, accepted", other);
+        b.clear();
+    }
+
+    element_to_bytes(x2, aibe->mpk.X);
+    CHECK(!memcmp(x1, x2, element_length_in_bytes(aibe->mpk.X)), "bundle: failed load replaced the mpk");
+    CHECK(aibe->decrypt(msg.data(), ct.data(), n) == 1000 && !memcmp(msg.data(), str.data(), 1000),
+          "bundle: keys changed by a failed load");
+    CHECK(!block_round_trip(aibe, id), "bundle: block round trip after failed loads");
+
+    // and the good one again, into the running instance
+    CHECK(!aibe->bundle_load(path, all), "bundle_load into the running instance failed");
+    CHECK(aibe->decrypt(msg.data(), ct.data(), n) == 1000, "bundle: reload changed the keys");
+    unlink(path);
+    unlink(bad_path);
+}
+
+// keygen2_batch() of KB_NUM requests of different identities, with kg2_pool off and filled: each
+// out[i] completes keygen3 with the client state of request i, as keygen2() of the same request
+// does, and no two keys share randomness
+#define KB_NUM 5
+
+void test_keygen2_batch(AibeAlgo *aibe) {
+    element_t t0s[KB_NUM], thetas[KB_NUM], Rs[KB_NUM], hzs[KB_NUM];
+    dk_t out[KB_NUM];
+    aibe_id_t ids[KB_NUM];
+    uint8_t buf[ELEM_MAX];
+
+    for (int i = 0; i < KB_NUM; ++i) {
+        char str[32];
+        snprintf(str, sizeof(str), "batch%d@aibe", i);
+        id_hash(&ids[i], str);
+        element_init_same_as(t0s[i], aibe->t0);
+        element_init_same_as(thetas[i], aibe->theta);
+        element_init_same_as(Rs[i], aibe->R);
+        element_init_same_as(hzs[i], aibe->Hz);
+        dk_init(&out[i], aibe->pairing);
+    }
+
+    for (int pooled = 0; pooled < 2; ++pooled) {
+        std::vector<std::vector<uint8_t>> d2s;
+
+        for (int i = 0; i < KB_NUM; ++i) {
+            aibe->keygen1(&ids[i]);
+            element_set(t0s[i], aibe->t0);
+            element_set(thetas[i], aibe->theta);
+            element_set(Rs[i], aibe->R);
+            element_set(hzs[i], aibe->Hz);
+        }
+        if (pooled) {
+            aibe->kg2_pool_cap = KB_NUM;
+            aibe->pools_start();
+            CHECK(aibe->kg2_pool && !pool_wait(aibe->kg2_pool, KB_NUM), "keygen2_batch: kg2_pool not filled");
+        }
+        aibe->keygen2_batch(Rs, hzs, KB_NUM, out);
+        if (pooled && aibe->kg2_pool)
+            CHECK(aibe->kg2_pool->hits == KB_NUM, "keygen2_batch: %llu pool hits",
+                  (unsigned long long) aibe->kg2_pool->hits);
+
+        for (int i = 0; i < KB_NUM; ++i) {
+            element_set(aibe->t0, t0s[i]);
+            element_set(aibe->theta, thetas[i]);
+            element_set(aibe->R, Rs[i]);
+            element_set(aibe->Hz, hzs[i]);
+            element_set(aibe->dk1.d1, out[i].d1);
+            element_set(aibe->dk1.d2, out[i].d2);
+            element_set(aibe->dk1.d3, out[i].d3);
+            CHECK(!aibe->keygen3(), "keygen2_batch: pool %d, key %d does not verify", pooled, i);
+            element_to_bytes(buf, out[i].d2);
+            d2s.emplace_back(buf, buf + element_length_in_bytes(out[i].d2));
+            // keygen2() of the same request
+            aibe->keygen2();
+            CHECK(!aibe->keygen3(), "keygen2_batch: pool %d, keygen2 of request %d does not verify", pooled, i);
+        }
+        for (int i = 0; i < KB_NUM; ++i) {
+            for (int j = 0; j < i; ++j) {
+                CHECK(d2s[i] != d2s[j], "keygen2_batch: pool %d, keys %d and %d share r1", pooled, j, i);
+            }
+        }
+    }
+    aibe->kg2_pool_cap = 0;
+    aibe->pools_stop();
+
+    for (int i = 0; i < KB_NUM; ++i) {
+        element_clear(t0s[i]);
+        element_clear(thetas[i]);
+        element_clear(Rs[i]);
+        element_clear(hzs[i]);
+        dk_clear(&out[i]);
+    }
+}
+
+// malloc calls of rounds block_encrypt + block_decrypt on bc after 3 warm-up rounds, -1 if a
+// round came back wrong; calls gets the arena allocations of the measured rounds
+int64_t steady_heap(AibeAlgo *aibe, blk_ctx_t *bc, const aibe_id_t *id, int rounds, uint64_t *calls) {
+    alloc_stats_t st0, st1;
+
+    element_random(bc->m);
+    for (int i = 0; i < 3; ++i) {
+        aibe->block_encrypt(bc, id);
+        aibe->block_decrypt(bc);
+    }
+    alloc_stats(&st0);
+    for (int i = 0; i < rounds; ++i) {
+        aibe->block_encrypt(bc, id);
+        aibe->block_decrypt(bc);
+    }
+    alloc_stats(&st1);
+    *calls = st1.calls - st0.calls;
+    return st1.heap - st0.heap;
+}
+
+// the arena: a warmed up thread makes no malloc calls in block_encrypt / block_decrypt, on the
+// calling thread and on one of its own, and the counts of an ended thread are kept
+void test_alloc(AibeAlgo *aibe, const aibe_id_t *id) {
+    uint64_t calls = 0, th_calls = 0;
+    int64_t heap, th_heap = -1;
+    alloc_stats_t st0, st1;
+
+    heap = steady_heap(aibe, &aibe->blk, id, 20, &calls);
+    CHECK(heap == 0, "alloc: steady state reached malloc %lld times", (long long) heap);
+    CHECK(calls > 0, "alloc: no arena allocations counted");
+    CHECK(!block_round_trip(aibe, id), "alloc: block round trip failed");
+
+    std::thread th([&]() {
+        blk_ctx_t bc;
+        alloc_thread_begin();
+        blk_ctx_init(&bc, aibe->pairing);
+        th_heap = steady_heap(aibe, &bc, id, 20, &th_calls);
+        alloc_stats(&st0);
+        blk_ctx_clear(&bc);
+        alloc_thread_end();
+    });
+    th.join();
+    alloc_stats(&st1);
+    CHECK(th_heap == 0, "alloc: steady state of a worker thread reached malloc %lld times", (long long) th_heap);
+    CHECK(th_calls > 0, "alloc: no arena allocations counted on the worker thread");
+    CHECK(st1.calls >= st0.calls && st1.heap >= st0.heap, "alloc: counts of the ended thread lost");
+}
+
+#define TT_SEED 2024
+#define TT_BLOCKS 3
+
+std::vector<uint8_t> elem_bytes(element_ptr e) {
+    std::vector<uint8_t> b(element_length_in_bytes(e));
+    element_to_bytes(b.data(), e);
+    return b;
+}
+
+// keygen3 and block_decrypt with task_threads 0 and 2 on the same inputs, and the same r2 from a
+// fixed seed, give the same bytes, with and without the preprocessed dk. A block_decrypt of blk
+// inside parallel_blocks() does not split into tasks and gives them as well.
+void test_task_threads(const char *param, const aibe_id_t *id) {
+    AibeAlgo a;
+    std::vector<uint8_t> dk[2], m, out[2], par[TT_BLOCKS];
+    int depth[TT_BLOCKS];
+
+    a.workers = TT_BLOCKS;
+    a.task_threads = 2;
+    // no pool thread draws from the seeded random source
+    a.enc_pool_cap = a.kg1_pool_cap = a.kg2_pool_cap = 0;
+    fresh_keys(&a, param, id);
+    CHECK(a.task_pool && a.task_pool->threads >= 2, "task threads: no pool of 2 threads");
+
+    a.keygen1(id);
+    a.keygen2();
+    for (int k = 0; k < 2; ++k) {
+        a.task_threads = 2 * k;
+        pbc_random_set_deterministic(TT_SEED);
+        CHECK(!a.keygen3(), "task threads %d: keygen3 failed", a.task_threads);
+        dk[k] = elem_bytes(a.dk.d1);
+        for (element_ptr e : {a.dk.d2, a.dk.d3}) {
+            std::vector<uint8_t> b = elem_bytes(e);
+            dk[k].insert(dk[k].end(), b.begin(), b.end());
+        }
+    }
+    pbc_random_set_file((char *) "/dev/urandom");
+    CHECK(dk[0] == dk[1], "task threads: keygen3 differs from the serial one");
+
+    for (int pp = 0; pp < 2; ++pp) {
+        if (pp)
+            a.dk_pp_init();
+        else
+            a.dk_pp_clear();
+        element_random(a.blk.m);
+        m = elem_bytes(a.blk.m);
+        a.block_encrypt(&a.blk, id);
+        for (int k = 0; k < 2; ++k) {
+            a.task_threads = 2 * k;
+            a.block_decrypt(&a.blk);
+            out[k] = elem_bytes(a.blk.m);
+        }
+        CHECK(out[0] == m, "task threads: pp %d, serial block_decrypt failed", pp);
+        CHECK(out[1] == out[0], "task threads: pp %d, block_decrypt differs from the serial one", pp);
+
+        // the other blocks decrypt a copy of the ciphertext in blk, which is only read
+        a.parallel_blocks(TT_BLOCKS, [&](blk_ctx_t *bc, int i) {
+            if (bc != &a.blk) {
+                element_set(bc->ct.c1, a.blk.ct.c1);
+                element_set(bc->ct.c2, a.blk.ct.c2);
+                element_set(bc->ct.c3, a.blk.ct.c3);
+                element_set(bc->ct.c4, a.blk.ct.c4);
+            }
+            depth[i] = a.par_depth;
+            a.block_decrypt(bc);
+            par[i] = elem_bytes(bc->m);
+        });
+        CHECK(!a.par_depth, "task threads: par_depth %d after parallel_blocks", a.par_depth);
+        for (int i = 0; i < TT_BLOCKS; ++i) {
+            CHECK(depth[i] == 1, "task threads: block %d ran at par_depth %d", i, depth[i]);
+            CHECK(par[i] == m, "task threads: pp %d, block_decrypt of block %d in parallel_blocks failed", pp, i);
+        }
+    }
+}
+
+// encrypt() / decrypt() of strings, and the in-memory formats with their tamper checks
+void test_messages(AibeAlgo *aibe, const aibe_id_t *id) {
+    const int lens[] = {0, 1, 127, 128, 129, 1000};
+
+    for (int mode = AIBE_MODE_BLOCK; mode <= AIBE_MODE_HYBRID; ++mode) {
+        for (int auth = 0; auth < 2; ++auth) {
+            for (int len : lens) {
+                std::vector<char> str(len + 1, 'a');
+                str[len] = '\0';
+                aibe->mode = mode;
+                aibe->block_auth = auth;
+                int size = mode == AIBE_MODE_HYBRID ? aibe->hybrid_size(len) : aibe->block_ct_size(len);
+                std::vector<uint8_t> ct(size), msg(size + 1);
+                int ct_len = aibe->encrypt(ct.data(), str.data(), id);
+                CHECK(ct_len == size, "mode %d auth %d %d: size %d, expected %d", mode, auth, len, ct_len, size);
+                int n = aibe->decrypt(msg.data(), ct.data(), ct_len);
+                CHECK(n == len && !memcmp(msg.data(), str.data(), len), "mode %d auth %d %d: round trip failed",
+                      mode, auth, len);
+                if (mode == AIBE_MODE_HYBRID || auth) {
+                    // header or chunk damage must be caught, and with auth the identity, the tag
+                    // and the first block
+                    int hybrid = mode == AIBE_MODE_HYBRID;
+                    for (int p : {(int) sizeof(aibe_magic) + 2, hybrid ? ct_len / 2 : AUTH_FIELDS,
+                                  hybrid ? ct_len - 1 : AUTH_HEADER_SIZE + 1}) {
+                        std::vector<uint8_t> bad(ct.begin(), ct.begin() + ct_len);
+                        bad[p] ^= 0x01;
+                        CHECK(aibe->decrypt(msg.data(), bad.data(), ct_len) < 0,
+                              "mode %d auth %d %d: byte %d flipped, still accepted", mode, auth, len, p);
+                    }
+                }
+            }
+        }
+    }
+    aibe->block_auth = AIBE_BLOCK_AUTH;
+
+    // binary data through the hybrid and broadcast formats
+    std::vector<uint8_t> data = test_data(1000);
+    std::vector<uint8_t> ct(aibe->hybrid_size(data.size())), msg(ct.size() + 1);
+    int n = aibe->encrypt_hybrid(ct.data(), data.data(), data.size(), id);
+    CHECK(aibe->decrypt(msg.data(), ct.data(), n) == (int) data.size() && !memcmp(msg.data(), data.data(), data.size()),
+          "hybrid binary: round trip failed");
+
+    // an unknown mode byte is rejected, not read as plain blocks
+    for (int mode = AIBE_MODE_BLOCK; mode <= AIBE_MODE_HYBRID; ++mode) {
+        std::vector<char> str(1000, 'a');
+        str.push_back('\0');
+        aibe->mode = mode;
+        std::vector<uint8_t> good(mode == AIBE_MODE_HYBRID ? aibe->hybrid_size(1000) : aibe->block_ct_size(1000));
+        int len = aibe->encrypt(good.data(), str.data(), id);
+        for (int f : bad_flags) {
+            std::vector<uint8_t> bad = good;
+            bad[sizeof(aibe_magic)] = (uint8_t) f;
+            CHECK(aibe->decrypt(msg.data(), bad.data(), len) < 0, "mode %d: mode byte 0x%02x accepted", mode, f);
+        }
+    }
+
+    aibe_id_t ids[3];
+    id_hash(&ids[0], "first@aibe");
+    ids[1] = *id;
+    id_hash(&ids[2], "third@aibe");
+    ct.resize(aibe->bcast_size(data.size(), 3));
+    msg.resize(ct.size() + 1);
+    n = aibe->encrypt_bcast(ct.data(), data.data(), data.size(), ids, 3);
+    CHECK(aibe->decrypt_bcast(msg.data(), ct.data(), n, id) == (int) data.size()
+          && !memcmp(msg.data(), data.data(), data.size()), "broadcast: round trip failed");
+    ct[sizeof(aibe_magic)] |= AIBE_FMT_LEN;
+    CHECK(aibe->decrypt_bcast(msg.data(), ct.data(), n, id) < 0, "broadcast: mode byte with LEN accepted");
+    ct[sizeof(aibe_magic)] &= ~AIBE_FMT_LEN;
+    ct[n - 1] ^= 0x01;
+    CHECK(aibe->decrypt_bcast(msg.data(), ct.data(), n, id) < 0, "broadcast: last byte flipped, still accepted");
+}
+
+int main(int argc, char *argv[]) {
+    const char *param = argc > 1 ? argv[1] : "../client/param/aibe.param";
+    char dir[] = "/tmp/aibe_test.XXXXXX";
+    char full[PATH_MAX];
+    AibeAlgo aibe;
+    aibe_id_t id;
+
+    alloc_install();
+    alloc_thread_begin();
+
+    if (aibe.load_param(param)) {
+        fprintf(stderr, "usage: %s [param file]\n", argv[0]);
+        return 2;
+    }
+    id_hash(&id, ID);
+    // before any other instance has pool threads drawing random elements
+    test_task_threads(param, &id);
+    aibe.init();
+    aibe.dk_id = id;
+    aibe.dk_id_set = 1;
+    // the bundle test also loads a.param beside it, both before the chdir below
+    if (!realpath(param, full)) {
+        fprintf(stderr, "%s: no such file\n", param);
+        return 2;
+    }
+    std::string param_full = full, other_full = param_full.substr(0, param_full.rfind('/') + 1) + "a.param";
+
+    if (!mkdtemp(dir) || chdir(dir) || mkdir("param", 0700)) {
+        fprintf(stderr, "scratch directory failed\n");
+        return 2;
+    }
+    aibe.pkg_setup_generate();
+    aibe.mpk_load();
+    aibe.msk_load();
+    aibe.keygen1(&id);
+    aibe.keygen2();
+    CHECK(!aibe.keygen3(), "keygen3: key verify failed");
+    // a tampered d1 must fail the check
+    aibe.keygen1(&id);
+    aibe.keygen2();
+    element_random(aibe.dk1.d1);
+    CHECK(aibe.keygen3(), "keygen3: bad key accepted");
+    aibe.keygen1(&id);
+    aibe.keygen2();
+    CHECK(!aibe.keygen3(), "keygen3: key verify failed");
+    aibe.dk_store();
+    CHECK(!aibe.dk_load(), "dk_load: stored key rejected");
+    test_dk_pp(&aibe, &id);
+    test_alloc(&aibe, &id);
+    test_dk_verify(&aibe, &id);
+    test_enc_pool(&aibe, &id);
+    test_kg_pools(&aibe, &id);
+    test_keygen2_batch(&aibe);
+    CHECK(!aibe.dk_load(), "dk_load: stored key rejected");
+    test_bundle(&aibe, &id, param_full.c_str(), other_full.c_str());
+
+    // both GT formats where the params allow compression
+    for (int gt_comp = 0; gt_comp <= (aibe.size_Fq ? 1 : 0); ++gt_comp) {
+        aibe.gt_comp = gt_comp;
+        test_messages(&aibe, &id);
+        test_streams(&aibe, &id);
+        test_auth_streams(&aibe, &id);
+        test_cont_random(&aibe, &id);
+    }
+
+    unlink(mpk_path);
+    unlink(msk_path);
+    unlink(dk_path);
+    rmdir("param");
+    if (chdir("/") == 0)
+        rmdir(dir);
+    aibe.clear();
+    alloc_thread_end();
+
+    if (test_failed) {
+        fprintf(stderr, "%d checks failed\n", test_failed);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
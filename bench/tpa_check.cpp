@@ -0,0 +1,135 @@
+//
+// Compares the tpa pairing backend with PBC, byte for byte, on fixed and random inputs. Needs
+// type a params; exits non-zero on any mismatch.
+//
+// usage: tpa_check [param file] [random rounds]
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "aibe.h"
+
+#define CHECK_MAX 4
+
+int check_failed = 0;
+
+// out of PBC against prod and pp_prod of b for the first num pairs, name in the report
+void check_pairs(backend_t *b, pairing_t pairing, element_t *in1, element_t *in2, int num, const char *name) {
+    element_t e1, e2;
+    void *pp[CHECK_MAX];
+    uint8_t buf1[ELEM_MAX], buf2[ELEM_MAX];
+    int len = pairing_length_in_bytes_GT(pairing);
+
+    element_init_GT(e1, pairing);
+    element_init_GT(e2, pairing);
+
+    if (num == 1)
+        element_pairing(e1, in1[0], in2[0]);
+    else
+        element_prod_pairing(e1, in1, in2, num);
+    element_to_bytes(buf1, e1);
+
+    b->prod(b->ctx, e2, in1, in2, num);
+    element_to_bytes(buf2, e2);
+    if (memcmp(buf1, buf2, len)) {
+        fprintf(stderr, "%s, %d pairs: prod differs from PBC\n", name, num);
+        check_failed++;
+    }
+
+    for (int i = 0; i < num; ++i) {
+        pp[i] = b->pp_new(b->ctx, in1[i]);
+    }
+    b->pp_prod(b->ctx, e2, pp, in2, num);
+    element_to_bytes(buf2, e2);
+    if (memcmp(buf1, buf2, len)) {
+        fprintf(stderr, "%s, %d pairs: pp_prod differs from PBC\n", name, num);
+        check_failed++;
+    }
+    for (int i = 0; i < num; ++i) {
+        b->pp_free(b->ctx, pp[i]);
+    }
+
+    element_clear(e1);
+    element_clear(e2);
+}
+
+int main(int argc, char *argv[]) {
+    const char *param = argc > 1 ? argv[1] : "../client/param/aibe.param";
+    int rounds = argc > 2 ? atoi(argv[2]) : 200;
+    AibeAlgo aibe;
+    backend_t b;
+    element_t in1[CHECK_MAX], in2[CHECK_MAX], t;
+    char seed[32];
+
+    if (aibe.load_param(param)) {
+        fprintf(stderr, "usage: %s [param file] [random rounds]\n", argv[0]);
+        return 2;
+    }
+    if (!aibe.size_Fq || backend_tpa(&b, aibe.pairing, aibe.gt_q, aibe.size_Fq)) {
+        fprintf(stderr, "%s: no tpa backend for these params\n", param);
+        return 1;
+    }
+
+    for (int i = 0; i < CHECK_MAX; ++i) {
+        element_init_G1(in1[i], aibe.pairing);
+        element_init_G1(in2[i], aibe.pairing);
+    }
+    element_init_G1(t, aibe.pairing);
+
+    // fixed points from hashes, so a failure reproduces
+    for (int i = 0; i < CHECK_MAX; ++i) {
+        snprintf(seed, sizeof(seed), "tpa_check P%d", i);
+        element_from_hash(in1[i], seed, strlen(seed));
+        snprintf(seed, sizeof(seed), "tpa_check Q%d", i);
+        element_from_hash(in2[i], seed, strlen(seed));
+    }
+    for (int num = 1; num <= CHECK_MAX; ++num) {
+        check_pairs(&b, aibe.pairing, in1, in2, num, "fixed");
+    }
+
+    // e(P, P), e(P, -P) e(P, P) = 1, and pairs with a point at infinity on either side
+    element_set(in2[0], in1[0]);
+    check_pairs(&b, aibe.pairing, in1, in2, 1, "P == Q");
+    element_neg(t, in1[0]);
+    element_set(in1[1], in1[0]);
+    element_set(in2[1], t);
+    check_pairs(&b, aibe.pairing, in1, in2, 2, "inverse pair");
+    element_set0(in1[2]);
+    check_pairs(&b, aibe.pairing, in1 + 2, in2 + 2, 1, "O first");
+    check_pairs(&b, aibe.pairing, in1, in2, 3, "O first");
+    element_set0(in1[0]);
+    element_set0(in1[1]);
+    check_pairs(&b, aibe.pairing, in1, in2, 3, "all O first");
+    snprintf(seed, sizeof(seed), "tpa_check P%d", 2);
+    element_from_hash(in1[2], seed, strlen(seed));
+    element_set0(in2[2]);
+    check_pairs(&b, aibe.pairing, in1 + 2, in2 + 2, 1, "O second");
+
+    // random pairs
+    for (int r = 0; r < rounds; ++r) {
+        int num = 1 + r % CHECK_MAX;
+        for (int i = 0; i < num; ++i) {
+            element_random(in1[i]);
+            element_random(in2[i]);
+        }
+        check_pairs(&b, aibe.pairing, in1, in2, num, "random");
+    }
+
+    for (int i = 0; i < CHECK_MAX; ++i) {
+        element_clear(in1[i]);
+        element_clear(in2[i]);
+    }
+    element_clear(t);
+    backend_clear(&b);
+
+    if (check_failed) {
+        fprintf(stderr, "%d checks failed\n", check_failed);
+        return 1;
+    }
+    printf("tpa matches PBC on %d random rounds\n", rounds);
+    return 0;
+}
@@ -8,20 +8,197 @@
 #include <pbc/pbc.h>
 #include <pbc/pbc_test.h>
 #include <cmath>
-
-#define N 8
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "tpa.h"
+
+// identity bits, identities are SHA-256 digests of the identity string truncated to N bits
+#define N 256
+#define ID_BYTES (N / 8)
 #define BLOCK_MAX 8
+// bound of the stack scratch buffers for one serialised element; load_param() rejects params
+// with larger elements
+#define ELEM_MAX 1024
+
+// fixed-base exponentiation tables for the long-lived bases, 0 to disable
+#ifndef AIBE_FIXED_BASE
+#define AIBE_FIXED_BASE 1
+#endif
+#define FB_WINDOW 5
+// pairing preprocessing of the loaded decryption key for block_decrypt(), 0 to disable
+#ifndef AIBE_DK_PP
+#define AIBE_DK_PP 1
+#endif
+// bits per window of the Z-product tables for Hz
+#ifndef HZ_WINDOW
+#define HZ_WINDOW 4
+#endif
+#define MP_MAX 4
+// size of the random exponents of the batch key verification
+#define BV_DELTA_BITS 64
+// pair with the in-tree type a backend (tpa.h) when the params allow it and it agrees with PBC,
+// 0 to always use PBC
+#ifndef AIBE_TPA
+#define AIBE_TPA 1
+#endif
+
+// block engine threads, 0 for one per hardware thread
+#ifndef AIBE_WORKERS
+#define AIBE_WORKERS 0
+#endif
+#define STREAM_BATCH 16
+// threads that run the independent pairings of one keygen3() or block_decrypt() call side by
+// side besides the calling one, 0 to keep them in one multi-pairing on the calling thread. Both
+// share the worker pool that init() starts.
+#ifndef AIBE_TASK_THREADS
+#define AIBE_TASK_THREADS 0
+#endif
+
+// arena allocator for GMP and PBC, see alloc_install(): size classes 16 B .. 64 KiB, larger blocks
+// go straight to malloc; ARENA_KEEP free blocks are cached per class and thread
+#define ARENA_CLASSES 13
+#define ARENA_KEEP 256
+#define ARENA_HEADER 16
+
+// per-operation counters and timers, see aibe_stats(); 0 compiles them out
+#ifndef AIBE_STATS
+#define AIBE_STATS 0
+#endif
+// counted primitives
+#define STAT_PAIRING 0
+#define STAT_POW_G1 1
+#define STAT_POW_GT 2
+#define STAT_DECOMPRESS 3
+#define STAT_RANDOM 4
+#define STAT_NUM 5
+// timed operations
+#define OP_KEYGEN1 0
+#define OP_KEYGEN2 1
+#define OP_KEYGEN3 2
+#define OP_BLOCK_ENCRYPT 3
+#define OP_BLOCK_DECRYPT 4
+#define OP_CT_LOAD 5
+#define OP_CT_STORE 6
+#define OP_NUM 7
+
+// offline tuples (s, X^s, e(g, h)^s, e(g, Y)^s) kept ready for block_encrypt, 0 to disable
+#ifndef AIBE_ENC_POOL
+#define AIBE_ENC_POOL 0
+#endif
+// request independent keygen randomness kept ready: (t0, theta, R) for keygen1 on the client,
+// (r1, t1, (Y * h^t1)^(1/x), X^r1) for keygen2 on the PKG; 0 to disable
+#ifndef AIBE_KG1_POOL
+#define AIBE_KG1_POOL 0
+#endif
+#ifndef AIBE_KG2_POOL
+#define AIBE_KG2_POOL 0
+#endif
+
+// ciphertext modes: one A-IBE block per size_msg_block bytes, or one KEM block + AES-256-GCM
+#define AIBE_MODE_BLOCK 0
+#define AIBE_MODE_HYBRID 1
+// one shared KEM block with a c2 per recipient, see AibeAlgo::encrypt_bcast(); never the default
+#define AIBE_MODE_BCAST 2
+#ifndef AIBE_MODE
+#define AIBE_MODE AIBE_MODE_HYBRID
+#endif
+// format flags stored with the mode byte of the header
+#define AIBE_MODE_MASK 0x1f
+#define AIBE_FMT_LEN 0x20
+#define AIBE_FMT_AUTH 0x40
+#define AIBE_FMT_GTC 0x80
+// encrypt() writes block mode with the authenticated header of AibeAlgo::decrypt_auth() and
+// encrypt_stream() with the tag of AibeAlgo::encrypt_stream_block(), 0 for the plain block format
+#ifndef AIBE_BLOCK_AUTH
+#define AIBE_BLOCK_AUTH 1
+#endif
+// decrypt(), decrypt_stream() and cont_attach() refuse block mode without that header or tag, for
+// callers fed untrusted input
+#ifndef AIBE_REQUIRE_AUTH
+#define AIBE_REQUIRE_AUTH 0
+#endif
+// authenticated block header: magic | mode | identity | block count(4) | param fingerprint | tag
+#define AUTH_FP_SIZE 8
+#define AUTH_TAG_SIZE 16
+#define AUTH_FIELDS (4 + 1 + ID_BYTES + 4 + AUTH_FP_SIZE)
+#define AUTH_HEADER_SIZE (AUTH_FIELDS + AUTH_TAG_SIZE)
+// authenticated block stream: magic | mode | identity | param fingerprint, then the blocks, the
+// plaintext length and the tag, see AibeAlgo::encrypt_stream_block()
+#define AUTH_STREAM_HEADER_SIZE (4 + 1 + ID_BYTES + AUTH_FP_SIZE)
+// write GT elements in torus-compressed form when the curve allows it (type a), 0 to disable
+#ifndef AIBE_GT_COMPRESS
+#define AIBE_GT_COMPRESS 1
+#endif
+#define DEM_KEY_SIZE 32
+#define DEM_IV_SIZE 12
+#define DEM_TAG_SIZE 16
+#define DEM_CHUNK 65536
+#define DEM_LAST 0x80000000u
+#define DEM_REC_OVERHEAD (4 + DEM_TAG_SIZE)
+// SHA-256 of the ciphertext header, authenticated with every chunk record
+#define DEM_HD_SIZE SHA256_DIGEST_LENGTH
+// block streams with AIBE_FMT_LEN end with the plaintext length, big-endian
+#define STREAM_LEN_SIZE 8
+
+// container header, integers big-endian: magic(4) | version(1) | mode flags(1) | reserved(2)
+// | param file SHA-256 | identity | unit count(8) | plaintext length(8) | index offset(8)
+#define CONT_VERSION 1
+
+// key bundle sections beside the mpk, see AibeAlgo::bundle_store()
+#define BUNDLE_VERSION 2
+#define BUNDLE_MSK 0x01
+#define BUNDLE_DK 0x02
+#define BUNDLE_TABLES 0x04
+
+// parameter profile, the name of a file in param_dir without .param
+#ifndef AIBE_PROFILE
+#define AIBE_PROFILE "aibe"
+#endif
+#define CONT_HEADER_SIZE (8 + SHA256_DIGEST_LENGTH + ID_BYTES + 24)
 
 const int z_size = N + 1;
-const int ID = 0b10101010;
+const char ID[] = "user@aibe";
 const char param_path[] = "param/aibe.param";
+const char param_dir[] = "param/";
 const char mpk_path[] = "param/mpk.out";
 const char msk_path[] = "param/msk.out";
 const char dk_path[] = "param/dk.out";
 const char ct_path[] = "ct.out";
 const char msg_path[] = "msg.txt";
 const char out_path[] = "out.txt";
+const char bundle_path[] = "param/keys.bundle";
+const uint8_t aibe_magic[4] = {'A', 'I', 'B', 'E'};
+const char kem_label[] = "AIBE-KEM";
+// no longer than kem_label, see load_param()
+const char auth_label[] = "AIBE-TAG";
+const char pad_label[] = "AIBE-PAD";
+const uint8_t cont_magic[4] = {'A', 'I', 'B', 'C'};
+const uint8_t bundle_magic[4] = {'A', 'I', 'B', 'K'};
+
 
+typedef struct aibe_id_t {
+    uint8_t v[ID_BYTES];
+} aibe_id_t;
 
 typedef struct mpk_t {
     element_t X, Y, h, Z[N + 1];
@@ -33,12 +210,266 @@ typedef struct dk_t {
 
 typedef struct ct_t {
     element_t c1, c2, c3, c4; // G1, G1, GT, GT
-};
+} ct_t;
+
+// per-thread scratch of the block operations, the keys and tables in AibeAlgo are only read
+typedef struct blk_ctx_t {
+    element_t s; // Zr
+    element_t Hz; // G1
+    element_t m; // GT
+    element_t gt1, gt2; // GT
+    element_t mp1[2], mp2[2]; // G1, G2
+    ct_t ct;
+} blk_ctx_t;
+
+// state of dk_verify_batch(): the keys, their random exponents and multi-pairing operands
+typedef struct bv_t {
+    dk_t *dks;
+    element_t *hzs;
+    mpz_t *delta;
+    element_t *in1, *in2;
+    int *bad;
+} bv_t;
+
+// chunk record offsets, relative to the start of the payload, and plaintext length collected
+// while a container payload is written; block units are fixed size and get no offsets
+typedef struct cont_index_t {
+    std::vector<uint64_t> off;
+    uint64_t plain_len;
+} cont_index_t;
+
+// A container mapped by cont_open(). Units are the A-IBE blocks or the DEM chunk records of the
+// payload. For chunk records index holds count + 1 big-endian file offsets, the last one is
+// index_off; blocks have no index (NULL, index_off is the file size) and sit every unit_size
+// bytes from unit_base.
+typedef struct aibe_cont_t {
+    uint8_t *base;
+    uint64_t size;
+    int flags;
+    const uint8_t *param_hash, *id;
+    uint64_t count, plain_len, index_off;
+    const uint8_t *index;
+    // set by AibeAlgo::cont_attach()
+    int mode, unit_plain;
+    uint64_t unit_base, unit_size;
+    uint8_t key[DEM_KEY_SIZE], hd[DEM_HD_SIZE];
+    const uint8_t *iv;
+} aibe_cont_t;
+
+// Bounded queue of precomputed element tuples, refilled by a background thread. The slots are
+// cap tuples of width elements each, the oldest one at head.
+typedef struct pool_t {
+    int width, cap, head, count, stop;
+    element_t *slots;
+    std::function<void(element_ptr *)> fill;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::thread th;
+    uint64_t hits, misses;
+} pool_t;
+
+// Worker threads started once by AibeAlgo::init(), each with its own arena and blk_ctx_t for its
+// lifetime, see AibeAlgo::run_parts(). A batch is the parts 1 .. parts - 1, worker h runs part
+// h + 1; one batch at a time, busy is held by the thread that posted it.
+typedef struct task_pool_t {
+    int threads, stop, parts, pending;
+    uint64_t gen;
+    void (*call)(void *arg, blk_ctx_t *bc, int part);
+    void *arg;
+    pairing_ptr pairing;
+    std::mutex mtx, busy;
+    std::condition_variable cv, done;
+    std::vector<std::thread> th;
+} task_pool_t;
+
+// per-thread free lists of the arena, singly linked through the second header word, and the
+// allocation counters of the thread: written by it alone, read by alloc_stats()
+typedef struct arena_t {
+    void *free[ARENA_CLASSES];
+    int num[ARENA_CLASSES];
+    int depth;
+    std::atomic<uint64_t> calls, heap;
+} arena_t;
+
+// allocation counters of the arena: every GMP / PBC allocation, and those that reached malloc
+typedef struct alloc_stats_t {
+    uint64_t calls, heap;
+} alloc_stats_t;
+
+// counts of the ended arenas and of threads without one; the live arenas are listed for
+// alloc_stats() under alloc_mtx
+std::atomic<uint64_t> alloc_calls(0), alloc_heap(0);
+std::mutex alloc_mtx;
+std::vector<arena_t *> alloc_arenas;
+thread_local arena_t *alloc_arena = NULL;
+
+// process-wide counters of all AibeAlgo instances and threads, see STAT_ADD() / STAT_TIME()
+typedef struct aibe_stats_t {
+    uint64_t count[STAT_NUM];
+    uint64_t calls[OP_NUM], ns[OP_NUM];
+} aibe_stats_t;
+
+std::atomic<uint64_t> stat_count[STAT_NUM], stat_calls[OP_NUM], stat_ns[OP_NUM];
+const char *const stat_names[STAT_NUM] = {"pairing", "pow_G1", "pow_GT", "decompress", "random"};
+const char *const op_names[OP_NUM] = {"keygen1", "keygen2", "keygen3", "block_encrypt", "block_decrypt",
+                                      "ct_load", "ct_store"};
+
+// adds its lifetime to the calls and time of op
+typedef struct stat_scope_t {
+    int op;
+    std::chrono::steady_clock::time_point start;
+
+    stat_scope_t(int op_) : op(op_), start(std::chrono::steady_clock::now()) {}
+
+    ~stat_scope_t() {
+        std::chrono::nanoseconds d = std::chrono::steady_clock::now() - start;
+        stat_calls[op].fetch_add(1, std::memory_order_relaxed);
+        stat_ns[op].fetch_add(d.count(), std::memory_order_relaxed);
+    }
+} stat_scope_t;
+
+#if AIBE_STATS
+#define STAT_ADD(k, n) stat_count[k].fetch_add(n, std::memory_order_relaxed)
+#define STAT_TIME(op) stat_scope_t stat_scope(op)
+#else
+#define STAT_ADD(k, n) ((void) 0)
+#define STAT_TIME(op) ((void) 0)
+#endif
+
+// fixed-base table: tab[(j << win) + v] = base^(v * 2^(win * j))
+typedef struct fb_t {
+    int win, rows;
+    element_t *tab;
+} fb_t;
+
+// Pairings of AibeAlgo, see backend_pbc() and backend_tpa(). Operands are G1 elements, a pp is
+// the precomputed Miller lines of one first argument. All functions may run on several threads.
+typedef struct backend_t {
+    const char *name;
+    void *ctx;
+    // out = prod e(in1[i], in2[i]) for i < num
+    void (*prod)(void *ctx, element_t out, element_t *in1, element_t *in2, int num);
+    void *(*pp_new)(void *ctx, element_t p);
+    // out = prod e(p_i, in[i]) for i < num, p_i the argument of pp[i]
+    void (*pp_prod)(void *ctx, element_t out, void **pp, element_t *in, int num);
+    void (*pp_free)(void *ctx, void *pp);
+    void (*free)(void *ctx);
+} backend_t;
+
+// backend_check() result of a param file, kept for the process under backend_mtx
+typedef struct backend_seen_t {
+    uint8_t param_hash[SHA256_DIGEST_LENGTH];
+    int ok;
+} backend_seen_t;
+
+std::mutex backend_mtx;
+std::vector<backend_seen_t> backend_seen;
+
+void alloc_install();
+
+int arena_class(size_t size);
+
+void arena_count(std::atomic<uint64_t> &n);
+
+void *arena_alloc(size_t size);
+
+void *arena_resize(void *ptr, size_t size);
+
+void arena_free(void *ptr);
+
+void *gmp_alloc(size_t size);
+
+void *gmp_realloc(void *ptr, size_t old_size, size_t size);
+
+void gmp_free(void *ptr, size_t size);
+
+void alloc_thread_begin();
+
+void alloc_thread_end();
+
+void alloc_stats(alloc_stats_t *st);
+
+void aibe_stats(aibe_stats_t *st);
+
+void aibe_stats_reset();
+
+void aibe_stats_print(FILE *out, const aibe_stats_t *st);
+
+void fb_init(fb_t *fb, element_t base, int bits, int win);
+
+void fb_clear(fb_t *fb);
+
+void fb_pow(element_t out, fb_t *fb, mpz_t exp);
+
+void hz_tab_init(fb_t *tab, element_t *Z, int bits, int win);
+
+int fb_write(FILE *f, fb_t *fb);
+
+int fb_read(fb_t *fb, element_t proto, int bits, int win, const uint8_t *base, uint64_t size, uint64_t *it);
+
+int elem_write(FILE *f, element_t e);
+
+int elem_read(element_t e, const uint8_t *base, uint64_t size, uint64_t *it);
+
+void elem_random(element_t e);
+
+int elem_decompress(element_t e, unsigned char *buf);
+
+void elem_swap(element_t a, element_t b);
+
+void hz_tab_mul(element_t out, fb_t *tab, const aibe_id_t *id);
+
+void backend_pbc(backend_t *b, pairing_t pairing);
+
+int backend_tpa(backend_t *b, pairing_t pairing, mpz_t q, int size_Fq);
+
+void backend_clear(backend_t *b);
+
+void pbc_prod(void *ctx, element_t out, element_t *in1, element_t *in2, int num);
+
+void *pbc_pp_new(void *ctx, element_t p);
+
+void pbc_pp_prod(void *ctx, element_t out, void **pp, element_t *in, int num);
+
+void pbc_pp_free(void *ctx, void *pp);
+
+void tpa_prod(void *ctx, element_t out, element_t *in1, element_t *in2, int num);
+
+void *tpa_pp_new(void *ctx, element_t p);
+
+void tpa_pp_prod(void *ctx, element_t out, void **pp, element_t *in, int num);
+
+void tpa_pp_free(void *ctx, void *pp);
+
+void tpa_free(void *ctx);
+
+void tpa_apply(tpa_t *t, element_t out, tpa_pp_t **pp, element_t *in, int num);
+
+pool_t *pool_new(element_ptr *proto, int width, int cap, std::function<void(element_ptr *)> fill);
+
+void pool_run(pool_t *pool);
+
+int pool_pop(pool_t *pool, element_ptr *out);
+
+void pool_free(pool_t *pool);
+
+task_pool_t *task_pool_new(int threads, pairing_t pairing);
+
+void task_pool_run(task_pool_t *tp, int h);
+
+void task_pool_free(task_pool_t *tp);
+
+template<typename F>
+void task_call(void *arg, blk_ctx_t *bc, int part);
 
 void ct_init(ct_t *ct, pairing_t pairing);
 
 void ct_clear(ct_t *ct);
 
+void blk_ctx_init(blk_ctx_t *bc, pairing_t pairing);
+
+void blk_ctx_clear(blk_ctx_t *bc);
+
 void mpk_init(mpk_t *mpk, pairing_t pairing);
 
 void mpk_clear(mpk_t *mpk);
@@ -51,17 +482,62 @@ void dk_to_bytes(uint8_t *data, dk_t *dk, int size_comp_G1);
 
 void dk_from_bytes(dk_t *dk, uint8_t *data, int size_comp_G1);
 
-int get_bit(int id, int n);
+void id_hash(aibe_id_t *id, const char *str);
+
+int get_bit(const aibe_id_t *id, int n);
 
 void data_xor(uint8_t *out, const uint8_t *d1, const uint8_t *d2, int size);
 
+int dem_encrypt(uint8_t *out, uint8_t *tag, const uint8_t *in, int len,
+                const uint8_t *key, const uint8_t *iv, const uint8_t *aad, int aad_len);
+
+int dem_decrypt(uint8_t *out, const uint8_t *tag, const uint8_t *in, int len,
+                const uint8_t *key, const uint8_t *iv, const uint8_t *aad, int aad_len);
+
+int chunk_seal(uint8_t *rec, const uint8_t *in, int len, int last,
+               const uint8_t *key, const uint8_t *iv, const uint8_t *hd, uint64_t seq);
+
+int chunk_open(uint8_t *out, const uint8_t *rec, int len,
+               const uint8_t *key, const uint8_t *iv, const uint8_t *hd, uint64_t seq);
+
+int chunks_seal(uint8_t *out, const uint8_t *data, int len,
+                const uint8_t *key, const uint8_t *iv, const uint8_t *hd);
+
+int chunks_open(uint8_t *msg, const uint8_t *data, int size,
+                const uint8_t *key, const uint8_t *iv, const uint8_t *hd);
+
+uint32_t chunk_field(const uint8_t *rec);
+
+void mpz_to_bytes_pad(uint8_t *out, mpz_t z, int size);
+
+void put_be64(uint8_t *p, uint64_t v);
+
+uint64_t get_be64(const uint8_t *p);
+
+uint64_t stream_blocks(uint64_t plain_len, int size_msg_block, int auth);
+
+void stream_tag(uint8_t *tag, const uint8_t *key, const uint8_t *digest);
+
+uint64_t cont_off(const aibe_cont_t *c, uint64_t i);
+
+int cont_open(aibe_cont_t *c, int fd);
+
+void cont_close(aibe_cont_t *c);
+
+void gt_compress(uint8_t *out, const uint8_t *in, mpz_t q, int size_Fq);
+
+void gt_decompress(uint8_t *out, const uint8_t *in, mpz_t q, int size_Fq);
+
 class AibeAlgo {
 public:
 
     // param elements
     element_t x; // Zr
+    element_t x_inv; // Zr: 1/x, set by msk_set()
     element_t g; // G2
     mpk_t mpk;
+    element_t egh; // GT: e(g, h)
+    element_t egY; // GT: e(g, Y)
 
     // user elements
     element_t Hz; // G1
@@ -72,66 +548,247 @@ public:
     element_t r2; // Zr: r''
     element_t el; // GT
     element_t er; // GT
-    element_t m;
-    ct_t ct;
+    blk_ctx_t blk; // scratch of the calling thread
 
     // pkg elements
     element_t r1; // Zr: r'
     element_t t1; // Zr
     dk_t dk; // d_ID
     dk_t dk1; // d'_ID
+    aibe_id_t dk_id; // identity of dk, checked by decrypt_auth() and cont_attach() when dk_id_set
+    int dk_id_set;
 
     // temp elements
     element_t tz; // Zr
     element_t tg; // G1
     element_t te; // GT
+    element_t mp1[MP_MAX], mp2[MP_MAX]; // G1, G2: pairing_prod operands
+
+    // fixed-base tables
+    int fixed_base;
+    fb_t fb_g, fb_X, fb_h; // G2, G1, G1
+    fb_t fb_egh, fb_egY; // GT, GT
+    fb_t hz_tab; // G1, windowed products of Z[1..N]
+    int dk_pp_use; // AIBE_DK_PP
+    int dk_pp;
+    void *pp_dk[2]; // backend pp of d2 and 1/d1
 
     pairing_t pairing;
+    backend_t backend;
 
     int size_comp_G1, size_comp_G2, size_Zr, size_GT, size_block, size_ct_block, size_ct, size_msg_block;
-
-    AibeAlgo(){};
+    int size_hyb_header;
+    int size_comp_GT; // GT as written by gt_store() in the current format
+    int size_Fq; // GT is in F_q^2, 0 if GT compression is unavailable
+    mpz_t gt_q;
+    uint8_t param_hash[SHA256_DIGEST_LENGTH];
+    char *param_text;
+    long param_len;
+
+    int mode;
+    int workers;
+    int gt_comp;
+    int tpa; // AIBE_TPA
+    int block_auth; // AIBE_BLOCK_AUTH
+    int require_auth; // AIBE_REQUIRE_AUTH
+    int fmt; // format flags of the ciphertext being processed
+
+    // background pools, started once their keys are loaded
+    pool_t *enc_pool, *kg1_pool, *kg2_pool;
+    int enc_pool_cap, kg1_pool_cap, kg2_pool_cap;
+    int msk_ready;
+
+    // started by init() with the larger of worker_num() - 1 and task_threads threads
+    task_pool_t *task_pool;
+    int task_threads;
+    int par_depth; // parallel_blocks() running on the calling thread
+
+    AibeAlgo() : dk_id_set(0), fixed_base(AIBE_FIXED_BASE), dk_pp_use(AIBE_DK_PP), dk_pp(0), pp_dk(), backend(),
+                 param_text(NULL), param_len(0), mode(AIBE_MODE), workers(AIBE_WORKERS), gt_comp(AIBE_GT_COMPRESS),
+                 tpa(AIBE_TPA), block_auth(AIBE_BLOCK_AUTH), require_auth(AIBE_REQUIRE_AUTH), fmt(0), enc_pool(NULL),
+                 kg1_pool(NULL), kg2_pool(NULL), enc_pool_cap(AIBE_ENC_POOL), kg1_pool_cap(AIBE_KG1_POOL),
+                 kg2_pool_cap(AIBE_KG2_POOL), msk_ready(0), task_pool(NULL), task_threads(AIBE_TASK_THREADS),
+                 par_depth(0) {};
 
     int run(FILE *OUTPUT);
 
     int load_param(const char *fn);
 
+    int load_profile(const char *name);
+
+    void fmt_set(int flags);
+
+    int fmt_check(int flags);
+
+    int fmt_default();
+
+    void gt_store(uint8_t *buf, element_t e);
+
+    void gt_load(element_t e, uint8_t *buf);
+
     void pkg_setup_generate();
 
+    void setup();
+
+    void mpk_precompute();
+
     void msk_load();
 
+    void msk_set();
+
     void mpk_load();
 
+    void mpk_fb_init();
+
+    void mpk_fb_clear();
+
+    void pow_fb(element_t out, fb_t *fb, element_t base, element_t exp);
+
+    void pairing_prod(element_t out, element_t *in1, element_t *in2, int num, int den);
+
+    void backend_init();
+
+    int backend_check(backend_t *b);
+
+    void hz_compute(element_t out, const aibe_id_t *id);
+
     void dk_store();
 
-    void dk_load();
+    int dk_load();
+
+    int dk_read(dk_t *out, const char *path);
+
+    int dk_check();
+
+    int dk_verify_files(const char *const *paths, const aibe_id_t *ids, int num, int *bad);
+
+    int bundle_store(const char *path, int sections);
+
+    int bundle_load(const char *path, int need);
+
+    void dk_pp_init();
+
+    void dk_pp_clear();
 
     void init();
 
-    void keygen1(int id);
+    void keygen1(const aibe_id_t *id);
 
     void keygen2();
 
+    void keygen2_batch(element_t *Rs, element_t *hzs, int num, dk_t *out);
+
+    void kg2_online(dk_t *out, element_t R_, element_t Hz_);
+
     int keygen3();
 
-    int block_encrypt(int id);
+    int dk_verify_batch(dk_t *dks, element_t *hzs, int num, int *bad);
+
+    int dk_verify_range(bv_t *bv, int lo, int hi);
+
+    int dk_verify_check(bv_t *bv, int lo, int hi);
+
+    int block_encrypt(blk_ctx_t *bc, const aibe_id_t *id);
+
+    void enc_offline(element_ptr *pre);
 
-    int block_decrypt();
+    void kg1_offline(element_ptr *pre);
+
+    void kg2_offline(element_ptr *pre);
+
+    void pools_start();
+
+    void pools_stop();
+
+    int block_decrypt(blk_ctx_t *bc);
+
+    int worker_num();
+
+    template<typename F>
+    void parallel_blocks(int num, F fn);
+
+    template<typename F>
+    void run_tasks(int num, F fn);
+
+    template<typename F>
+    void run_parts(int parts, F fn);
 
     void clear();
 
-    void ct_store(uint8_t *buf);
+    void ct_store(blk_ctx_t *bc, uint8_t *buf);
+
+    void ct_load(blk_ctx_t *bc, uint8_t *buf);
+
+    void block_pad(blk_ctx_t *bc, uint8_t *pad);
+
+    void seal_block(blk_ctx_t *bc, uint8_t *rec, const uint8_t *msg, const aibe_id_t *id);
+
+    void open_block(blk_ctx_t *bc, uint8_t *msg, uint8_t *rec);
+
+    void kem_key(blk_ctx_t *bc, uint8_t *key, const char *label = kem_label);
+
+    void auth_tag(uint8_t *tag, blk_ctx_t *bc, const uint8_t *hdr, const uint8_t *rec);
+
+    int hyb_seal_header(uint8_t *hdr, uint8_t *key, const aibe_id_t *id);
+
+    void hyb_open_header(uint8_t *hdr, uint8_t *key);
 
-    void ct_load(uint8_t *buf);
+    int hybrid_size(int len);
 
-    int encrypt(uint8_t *ct_buf, const char *str, int id);
+    int block_ct_size(int len);
 
-    void decrypt(uint8_t *msg, uint8_t *data, int size);
+    int encrypt(uint8_t *ct_buf, const char *str, const aibe_id_t *id);
+
+    int encrypt_hybrid(uint8_t *ct_buf, const uint8_t *data, int len, const aibe_id_t *id);
+
+    int decrypt(uint8_t *msg, uint8_t *data, int size);
+
+    int decrypt_hybrid(uint8_t *msg, uint8_t *data, int size);
+
+    int decrypt_auth(uint8_t *msg, uint8_t *data, int size);
+
+    int auth_stream_check(uint8_t *msg, uint8_t *data, uint64_t size);
+
+    int decrypt_auth_stream(uint8_t *msg, uint8_t *data, int size);
+
+    int bcast_size(int len, int num);
+
+    int bcast_header_size(int num);
+
+    int encrypt_bcast(uint8_t *ct_buf, const uint8_t *data, int len, const aibe_id_t *ids, int num);
+
+    int decrypt_bcast(uint8_t *msg, uint8_t *data, int size, const aibe_id_t *id);
+
+    int64_t encrypt_stream(FILE *in, FILE *out, const aibe_id_t *id, cont_index_t *idx = NULL);
+
+    int64_t encrypt_stream_block(FILE *in, FILE *out, const aibe_id_t *id, cont_index_t *idx = NULL);
+
+    int64_t decrypt_stream(FILE *in, FILE *out);
+
+    int64_t decrypt_stream_hybrid(FILE *in, FILE *out, const uint8_t *probe);
+
+    int64_t decrypt_stream_block(FILE *in, FILE *out, const uint8_t *probe, int n);
+
+    int64_t encrypt_container(FILE *in, FILE *out, const aibe_id_t *id);
+
+    int cont_attach(aibe_cont_t *c);
+
+    int64_t cont_decrypt(aibe_cont_t *c, uint64_t first, uint64_t num, uint8_t *out);
+
+    int64_t decrypt_stream_cont(FILE *in, FILE *out);
 };
 
 
-int get_bit(int id, int n) {
-    return (id >> (N - n)) & 1;
+void id_hash(aibe_id_t *id, const char *str) {
+    uint8_t md[SHA256_DIGEST_LENGTH];
+
+    SHA256((const unsigned char *) str, strlen(str), md);
+    memcpy(id->v, md, ID_BYTES);
+}
+
+// bit n of id for n = 1..N, most significant first
+int get_bit(const aibe_id_t *id, int n) {
+    return (id->v[(n - 1) >> 3] >> (7 - ((n - 1) & 7))) & 1;
 }
 
 void ct_init(ct_t *ct, pairing_t pairing) {
@@ -148,6 +805,32 @@ void ct_clear(ct_t *ct) {
     element_clear(ct->c4);
 }
 
+void blk_ctx_init(blk_ctx_t *bc, pairing_t pairing) {
+    element_init_Zr(bc->s, pairing);
+    element_init_G1(bc->Hz, pairing);
+    element_init_GT(bc->m, pairing);
+    element_init_GT(bc->gt1, pairing);
+    element_init_GT(bc->gt2, pairing);
+    for (int i = 0; i < 2; ++i) {
+        element_init_G1(bc->mp1[i], pairing);
+        element_init_G2(bc->mp2[i], pairing);
+    }
+    ct_init(&bc->ct, pairing);
+}
+
+void blk_ctx_clear(blk_ctx_t *bc) {
+    element_clear(bc->s);
+    element_clear(bc->Hz);
+    element_clear(bc->m);
+    element_clear(bc->gt1);
+    element_clear(bc->gt2);
+    for (int i = 0; i < 2; ++i) {
+        element_clear(bc->mp1[i]);
+        element_clear(bc->mp2[i]);
+    }
+    ct_clear(&bc->ct);
+}
+
 void mpk_init(mpk_t *mpk, pairing_t pairing) {
     element_init_G1(mpk->h, pairing);
     element_init_G1(mpk->X, pairing);
@@ -185,125 +868,771 @@ void dk_to_bytes(uint8_t *data, dk_t *dk, int size_comp_G1) {
 }
 
 void dk_from_bytes(dk_t *dk, uint8_t *data, int size_comp_G1) {
-    element_from_bytes_compressed(dk->d1, data);
-    element_from_bytes_compressed(dk->d2, data + size_comp_G1);
+    elem_decompress(dk->d1, data);
+    elem_decompress(dk->d2, data + size_comp_G1);
     element_from_bytes(dk->d3, data + size_comp_G1 * 2);
 }
 
-int AibeAlgo::run(FILE *OUTPUT) {
-
-    int ret = 0;
+// Allocator behind GMP and PBC once alloc_install() ran. Blocks carry a header with their size
+// class; inside alloc_thread_begin() / alloc_thread_end() freed blocks go to free lists of the
+// calling thread and are handed out again, so a warmed up thread does not touch malloc.
+void alloc_install() {
+    static std::once_flag once;
 
-    //aibe load_param
+    std::call_once(once, []() {
+        mp_set_memory_functions(gmp_alloc, gmp_realloc, gmp_free);
+        pbc_set_memory_functions(arena_alloc, arena_resize, arena_free);
+    });
+}
 
-    if (load_param(param_path)) {
-        ret = -1;
-        fprintf(stderr, "\nParam File Path error");
-        goto CLEANUP;
+// size class c holds 16 << c bytes, -1 for blocks past the largest class
+int arena_class(size_t size) {
+    for (int c = 0; c < ARENA_CLASSES; ++c) {
+        if (size <= (size_t) 16 << c)
+            return c;
     }
+    return -1;
+}
 
-    fprintf(OUTPUT, "\nA-IBE Success Set Up");
+// n++ on a counter of the own arena: a plain load and store, no locked add on a cache line
+// shared by all threads
+void arena_count(std::atomic<uint64_t> &n) {
+    n.store(n.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
 
-////    element init
-    init();
+void *arena_alloc(size_t size) {
+    int c = arena_class(size);
+    arena_t *a = alloc_arena;
+    uint8_t *p;
+
+    if (a)
+        arena_count(a->calls);
+    else
+        alloc_calls.fetch_add(1, std::memory_order_relaxed);
+    if (c >= 0 && a && a->free[c]) {
+        p = (uint8_t *) a->free[c];
+        a->free[c] = *(void **) (p + 8);
+        a->num[c]--;
+    } else {
+        if (a)
+            arena_count(a->heap);
+        else
+            alloc_heap.fetch_add(1, std::memory_order_relaxed);
+        p = (uint8_t *) malloc(ARENA_HEADER + (c >= 0 ? (size_t) 16 << c : size));
+        // GMP and PBC do not check for NULL
+        if (!p)
+            abort();
+        *(int32_t *) p = c;
+        *(size_t *) (p + 8) = size;
+    }
+    return p + ARENA_HEADER;
+}
 
-    mpk_load();
-    msk_load();
+void *arena_resize(void *ptr, size_t size) {
+    uint8_t *p = (uint8_t *) ptr - ARENA_HEADER;
+    size_t cap;
+    void *q;
+
+    if (!ptr)
+        return arena_alloc(size);
+    cap = *(int32_t *) p >= 0 ? (size_t) 16 << *(int32_t *) p : *(size_t *) (p + 8);
+    if (size <= cap)
+        return ptr;
+    q = arena_alloc(size);
+    memcpy(q, ptr, cap);
+    arena_free(ptr);
+    return q;
+}
 
-    puts("\nPKG: setup finished");
+void arena_free(void *ptr) {
+    uint8_t *p = (uint8_t *) ptr - ARENA_HEADER;
+    arena_t *a = alloc_arena;
+    int c;
+
+    if (!ptr)
+        return;
+    c = *(int32_t *) p;
+    if (c < 0 || !a || a->num[c] >= ARENA_KEEP) {
+        free(p);
+        return;
+    }
+    *(void **) (p + 8) = a->free[c];
+    a->free[c] = p;
+    a->num[c]++;
+}
 
-////    aibe: keygen1
+void *gmp_alloc(size_t size) {
+    return arena_alloc(size);
+}
 
-    keygen1(ID);
-    fprintf(OUTPUT, "\nA-IBE Success Keygen1 ");
+void *gmp_realloc(void *ptr, size_t, size_t size) {
+    return arena_resize(ptr, size);
+}
 
-    keygen2();
-    puts("\nPKG: keygen2 finished");
+void gmp_free(void *ptr, size_t) {
+    arena_free(ptr);
+}
 
-////    aibe: keygen3
-    if (keygen3()) {
-        fprintf(stderr, "\nKey verify failed");
-        goto CLEANUP;
+// nests; the outermost end hands the cached blocks back to malloc
+void alloc_thread_begin() {
+    if (!alloc_arena) {
+        alloc_arena = new arena_t();
+        alloc_arena->calls = 0;
+        alloc_arena->heap = 0;
+        std::lock_guard<std::mutex> lock(alloc_mtx);
+        alloc_arenas.push_back(alloc_arena);
     }
+    alloc_arena->depth++;
+}
 
-    fprintf(OUTPUT, "\nA-IBE Success Keygen3 ");
+void alloc_thread_end() {
+    arena_t *a = alloc_arena;
 
-////    element clear
-    CLEANUP:
+    if (!a || --a->depth > 0)
+        return;
+    alloc_arena = NULL;
+    {
+        // the counts outlive the arena
+        std::lock_guard<std::mutex> lock(alloc_mtx);
+        alloc_calls += a->calls.load(std::memory_order_relaxed);
+        alloc_heap += a->heap.load(std::memory_order_relaxed);
+        alloc_arenas.erase(std::find(alloc_arenas.begin(), alloc_arenas.end(), a));
+    }
+    for (int c = 0; c < ARENA_CLASSES; ++c) {
+        while (a->free[c]) {
+            uint8_t *p = (uint8_t *) a->free[c];
+            a->free[c] = *(void **) (p + 8);
+            free(p);
+        }
+    }
+    delete a;
+}
 
-    clear();
-    fprintf(OUTPUT, "\nSuccess Clean Up A-IBE ");
-    return ret;
+void alloc_stats(alloc_stats_t *st) {
+    std::lock_guard<std::mutex> lock(alloc_mtx);
 
+    st->calls = alloc_calls.load(std::memory_order_relaxed);
+    st->heap = alloc_heap.load(std::memory_order_relaxed);
+    for (arena_t *a : alloc_arenas) {
+        st->calls += a->calls.load(std::memory_order_relaxed);
+        st->heap += a->heap.load(std::memory_order_relaxed);
+    }
 }
 
-int AibeAlgo::load_param(const char *fn) {
-    int ret = 0;
-    char param[1024];
-    FILE *param_file = fopen(fn, "r");
-    size_t count = fread(param, sizeof(char), 1024, param_file);
-    if (!count) {
-        ret = -1;
-        goto CLEANUP;
+// all zero unless built with AIBE_STATS
+void aibe_stats(aibe_stats_t *st) {
+    for (int k = 0; k < STAT_NUM; ++k) {
+        st->count[k] = stat_count[k].load(std::memory_order_relaxed);
+    }
+    for (int op = 0; op < OP_NUM; ++op) {
+        st->calls[op] = stat_calls[op].load(std::memory_order_relaxed);
+        st->ns[op] = stat_ns[op].load(std::memory_order_relaxed);
     }
-    fclose(param_file);
-    pairing_init_set_buf(pairing, param, count);
-
-    size_comp_G1 = pairing_length_in_bytes_compressed_G1(pairing);
-    size_comp_G2 = pairing_length_in_bytes_compressed_G2(pairing);
-    size_GT = pairing_length_in_bytes_GT(pairing);
-    size_Zr = pairing_length_in_bytes_Zr(pairing);
-    size_ct_block = size_comp_G1 * 2 + size_GT * 2;
-    size_msg_block = size_GT;
-    size_block = size_msg_block + size_ct_block;
-    size_ct = BLOCK_MAX * size_block;
-
-    CLEANUP:
-    return ret;
 }
 
-void AibeAlgo::init() {
+void aibe_stats_reset() {
+    for (int k = 0; k < STAT_NUM; ++k) {
+        stat_count[k].store(0, std::memory_order_relaxed);
+    }
+    for (int op = 0; op < OP_NUM; ++op) {
+        stat_calls[op].store(0, std::memory_order_relaxed);
+        stat_ns[op].store(0, std::memory_order_relaxed);
+    }
+}
 
-    element_init_Zr(x, pairing);
-    element_init_G2(g, pairing);
-    mpk_init(&mpk, pairing);
+void aibe_stats_print(FILE *out, const aibe_stats_t *st) {
+    if (!AIBE_STATS) {
+        fprintf(out, "stats not compiled in, build with -DAIBE_STATS=1\n");
+        return;
+    }
+    for (int k = 0; k < STAT_NUM; ++k) {
+        fprintf(out, "%-16s %12llu\n", stat_names[k], (unsigned long long) st->count[k]);
+    }
+    fprintf(out, "%-16s %12s %14s %12s\n", "operation", "calls", "total_us", "mean_us");
+    for (int op = 0; op < OP_NUM; ++op) {
+        fprintf(out, "%-16s %12llu %14.1f %12.2f\n", op_names[op], (unsigned long long) st->calls[op],
+                st->ns[op] / 1e3, st->calls[op] ? st->ns[op] / 1e3 / st->calls[op] : 0.0);
+    }
+}
 
-    element_init_G1(Hz, pairing);
-    element_init_Zr(t0, pairing);
-    element_init_Zr(theta, pairing);
-    element_init_G1(R, pairing);
-    element_init_Zr(r, pairing);
-    element_init_Zr(r2, pairing);
-    element_init_GT(el, pairing);
-    element_init_GT(er, pairing);
-    element_init_GT(m, pairing);
-    ct_init(&ct, pairing);
+void fb_init(fb_t *fb, element_t base, int bits, int win) {
+    int cols = 1 << win;
+    element_t step;
+
+    fb->win = win;
+    fb->rows = (bits + win - 1) / win;
+    fb->tab = (element_t *) malloc(sizeof(element_t) * fb->rows * cols);
+
+    element_init_same_as(step, base);
+    element_set(step, base);
+    for (int j = 0; j < fb->rows; ++j) {
+        element_t *row = fb->tab + (j << win);
+        element_init_same_as(row[0], base);
+        element_set1(row[0]);
+        for (int v = 1; v < cols; ++v) {
+            element_init_same_as(row[v], base);
+            element_mul(row[v], row[v - 1], step);
+        }
+        // step = step^(2^win)
+        element_mul(step, row[cols - 1], step);
+    }
+    element_clear(step);
+}
 
-    element_init_Zr(r1, pairing);
-    element_init_Zr(t1, pairing);
-    dk_init(&dk, pairing);
-    dk_init(&dk1, pairing);
+void fb_clear(fb_t *fb) {
+    if (!fb->tab)
+        return;
+    for (int i = 0; i < fb->rows << fb->win; ++i) {
+        element_clear(fb->tab[i]);
+    }
+    free(fb->tab);
+    fb->tab = NULL;
+}
 
-    element_init_Zr(tz, pairing);
-    element_init_G1(tg, pairing);
-    element_init_GT(te, pairing);
+void fb_pow(element_t out, fb_t *fb, mpz_t exp) {
+    element_set1(out);
+    for (int j = 0; j < fb->rows; ++j) {
+        int v = 0;
+        for (int k = fb->win - 1; k >= 0; --k) {
+            v = (v << 1) | mpz_tstbit(exp, j * fb->win + k);
+        }
+        if (v)
+            element_mul(out, out, fb->tab[(j << fb->win) + v]);
+    }
+}
 
+// tab[(j << win) + v] = prod Z[1 + j * win + k] over the set bits k of v, most significant first,
+// so Hz takes one multiplication per window instead of one per identity bit
+void hz_tab_init(fb_t *tab, element_t *Z, int bits, int win) {
+    int cols = 1 << win;
+
+    tab->win = win;
+    tab->rows = (bits + win - 1) / win;
+    tab->tab = (element_t *) malloc(sizeof(element_t) * tab->rows * cols);
+
+    for (int j = 0; j < tab->rows; ++j) {
+        element_t *row = tab->tab + (j << win);
+        element_init_same_as(row[0], Z[0]);
+        element_set1(row[0]);
+        for (int v = 1; v < cols; ++v) {
+            int low = __builtin_ctz(v);
+            int n = j * win + win - low;
+            element_init_same_as(row[v], Z[0]);
+            if (n <= bits)
+                element_mul(row[v], row[v & (v - 1)], Z[n]);
+            else
+                element_set(row[v], row[v & (v - 1)]);
+        }
+    }
 }
 
-void AibeAlgo::pkg_setup_generate() {
+// out *= prod Z[n] over the set bits n of id
+void hz_tab_mul(element_t out, fb_t *tab, const aibe_id_t *id) {
+    for (int j = 0; j < tab->rows; ++j) {
+        int v = 0;
+        for (int k = 1; k <= tab->win; ++k) {
+            int n = j * tab->win + k;
+            v = (v << 1) | (n <= N ? get_bit(id, n) : 0);
+        }
+        if (v)
+            element_mul(out, out, tab->tab[(j << tab->win) + v]);
+    }
+}
+
+// generic PBC pairings, ctx is the pairing
+void backend_pbc(backend_t *b, pairing_t pairing) {
+    b->name = "pbc";
+    b->ctx = pairing;
+    b->prod = pbc_prod;
+    b->pp_new = pbc_pp_new;
+    b->pp_prod = pbc_pp_prod;
+    b->pp_free = pbc_pp_free;
+    b->free = NULL;
+}
+
+// tpa.h for type a params with F_q elements of size_Fq bytes, ctx is a tpa_t. Returns -1 if the
+// curve does not fit it.
+int backend_tpa(backend_t *b, pairing_t pairing, mpz_t q, int size_Fq) {
+    mpz_t h;
+    tpa_t *t;
+
+    if (pairing_length_in_bytes_G1(pairing) != 2 * size_Fq || pairing_length_in_bytes_GT(pairing) != 2 * size_Fq)
+        return -1;
+    mpz_init(h);
+    mpz_add_ui(h, q, 1);
+    if (mpz_fdiv_ui(q, 4) != 3 || !mpz_divisible_p(h, pairing->r)) {
+        mpz_clear(h);
+        return -1;
+    }
+    mpz_clear(h);
+
+    t = new tpa_t;
+    if (tpa_init(t, q, pairing->r, size_Fq)) {
+        delete t;
+        return -1;
+    }
+    b->name = "tpa";
+    b->ctx = t;
+    b->prod = tpa_prod;
+    b->pp_new = tpa_pp_new;
+    b->pp_prod = tpa_pp_prod;
+    b->pp_free = tpa_pp_free;
+    b->free = tpa_free;
+    return 0;
+}
+
+void backend_clear(backend_t *b) {
+    if (b->free)
+        b->free(b->ctx);
+    memset(b, 0, sizeof(*b));
+}
+
+void pbc_prod(void *ctx, element_t out, element_t *in1, element_t *in2, int num) {
+    (void) ctx;
+    element_prod_pairing(out, in1, in2, num);
+}
+
+void *pbc_pp_new(void *ctx, element_t p) {
+    pairing_pp_s *pp = (pairing_pp_s *) malloc(sizeof(pairing_pp_t));
+
+    pairing_pp_init(pp, p, (pairing_ptr) ctx);
+    return pp;
+}
+
+// one final exponentiation per pp, PBC has no shared one for them
+void pbc_pp_prod(void *ctx, element_t out, void **pp, element_t *in, int num) {
+    element_t tmp;
+
+    (void) ctx;
+    pairing_pp_apply(out, in[0], (pairing_pp_s *) pp[0]);
+    if (num < 2)
+        return;
+    element_init_same_as(tmp, out);
+    for (int i = 1; i < num; ++i) {
+        pairing_pp_apply(tmp, in[i], (pairing_pp_s *) pp[i]);
+        element_mul(out, out, tmp);
+    }
+    element_clear(tmp);
+}
+
+void pbc_pp_free(void *ctx, void *pp) {
+    (void) ctx;
+    if (!pp)
+        return;
+    pairing_pp_clear((pairing_pp_s *) pp);
+    free(pp);
+}
+
+// The Miller lines of in1 are built in per-thread scratch that keeps its capacity, like the
+// byte images in tpa_apply(), so steady-state calls do not allocate.
+void tpa_prod(void *ctx, element_t out, element_t *in1, element_t *in2, int num) {
+    thread_local std::vector<tpa_pp_t> pps;
+    thread_local std::vector<tpa_pp_t *> pp;
+    tpa_t *t = (tpa_t *) ctx;
+    uint8_t buffer[ELEM_MAX];
+
+    if ((int) pps.size() < num)
+        pps.resize(num);
+    pp.resize(num);
+    for (int i = 0; i < num; ++i) {
+        pp[i] = &pps[i];
+        pps[i].lines.clear();
+        // e(O, Q) = 1: no lines
+        if (element_is0(in1[i]) || element_is0(in2[i]))
+            continue;
+        element_to_bytes(buffer, in1[i]);
+        tpa_pp_init(t, &pps[i], buffer);
+    }
+    tpa_apply(t, out, pp.data(), in2, num);
+}
+
+void *tpa_pp_new(void *ctx, element_t p) {
+    tpa_pp_t *pp = new tpa_pp_t;
+    uint8_t buffer[ELEM_MAX];
+
+    if (!element_is0(p)) {
+        element_to_bytes(buffer, p);
+        tpa_pp_init((tpa_t *) ctx, pp, buffer);
+    }
+    return pp;
+}
+
+void tpa_pp_prod(void *ctx, element_t out, void **pp, element_t *in, int num) {
+    tpa_apply((tpa_t *) ctx, out, (tpa_pp_t **) pp, in, num);
+}
+
+void tpa_pp_free(void *ctx, void *pp) {
+    (void) ctx;
+    delete (tpa_pp_t *) pp;
+}
+
+void tpa_free(void *ctx) {
+    delete (tpa_t *) ctx;
+}
+
+// out = prod e(p_i, in[i]) in one tpa_eval(), pairs with p_i or in[i] at infinity left out
+void tpa_apply(tpa_t *t, element_t out, tpa_pp_t **pp, element_t *in, int num) {
+    thread_local std::vector<uint8_t> buf;
+    thread_local std::vector<tpa_pp_t *> ps;
+    thread_local std::vector<uint8_t *> qs;
+    uint8_t res[2 * 8 * TPA_LIMBS];
+    int w = 2 * t->len;
+    int n = 0;
+
+    buf.resize(num * w);
+    ps.resize(num);
+    qs.resize(num);
+    for (int i = 0; i < num; ++i) {
+        if (pp[i]->lines.empty() || element_is0(in[i]))
+            continue;
+        qs[n] = buf.data() + n * w;
+        element_to_bytes(qs[n], in[i]);
+        ps[n++] = pp[i];
+    }
+    tpa_eval(t, res, ps.data(), qs.data(), n);
+    element_from_bytes(out, res);
+}
+
+int AibeAlgo::run(FILE *OUTPUT) {
+
+    int ret = 0;
+
+    //aibe load_param
+
+    if (load_param(param_path)) {
+        ret = -1;
+        fprintf(stderr, "\nParam File Path error");
+        goto CLEANUP;
+    }
+
+    fprintf(OUTPUT, "\nA-IBE Success Set Up");
+
+////    element init
+    init();
+
+    mpk_load();
+    msk_load();
+
+    puts("\nPKG: setup finished");
+
+////    aibe: keygen1
+
+    {
+        aibe_id_t id;
+        id_hash(&id, ID);
+        keygen1(&id);
+    }
+    fprintf(OUTPUT, "\nA-IBE Success Keygen1 ");
+
+    keygen2();
+    puts("\nPKG: keygen2 finished");
+
+////    aibe: keygen3
+    if (keygen3()) {
+        fprintf(stderr, "\nKey verify failed");
+        goto CLEANUP;
+    }
+
+    fprintf(OUTPUT, "\nA-IBE Success Keygen3 ");
+
+////    element clear
+    CLEANUP:
+
+    clear();
+    fprintf(OUTPUT, "\nSuccess Clean Up A-IBE ");
+    return ret;
+
+}
+
+int AibeAlgo::load_param(const char *fn) {
+    int ret = 0;
+    char *param = NULL;
+    const char *q;
+    long count = 0;
+    FILE *param_file = fopen(fn, "r");
+
+    // the d, e and g param files are longer than 1 KB
+    if (!param_file || fseek(param_file, 0, SEEK_END) || (count = ftell(param_file)) <= 0
+        || fseek(param_file, 0, SEEK_SET)) {
+        ret = -1;
+        goto CLEANUP;
+    }
+    param = (char *) malloc(count + 1);
+    if (!param || fread(param, sizeof(char), count, param_file) != (size_t) count) {
+        ret = -1;
+        goto CLEANUP;
+    }
+    param[count] = '\0';
+    SHA256((const unsigned char *) param, count, param_hash);
+    if (pairing_init_set_buf(pairing, param, count)) {
+        ret = -1;
+        goto CLEANUP;
+    }
+    // the scheme pairs G1 elements with each other
+    if (!pairing_is_symmetric(pairing)) {
+        pairing_clear(pairing);
+        ret = -1;
+        goto CLEANUP;
+    }
+
+    size_comp_G1 = pairing_length_in_bytes_compressed_G1(pairing);
+    size_comp_G2 = pairing_length_in_bytes_compressed_G2(pairing);
+    size_GT = pairing_length_in_bytes_GT(pairing);
+    size_Zr = pairing_length_in_bytes_Zr(pairing);
+    // kem_key() puts the label in front of a GT element
+    if (pairing_length_in_bytes_G1(pairing) > ELEM_MAX || size_GT + (int) sizeof(kem_label) > ELEM_MAX) {
+        pairing_clear(pairing);
+        ret = -1;
+        goto CLEANUP;
+    }
+
+    // type a: GT is the order r subgroup of F_q[i], i^2 = -1, written as two F_q elements.
+    // gt_q lives as long as param_text, a reload reuses it and clear() frees both.
+    if (!param_text)
+        mpz_init(gt_q);
+    size_Fq = 0;
+    q = strstr(param, "\nq ");
+    if (!strncmp(param, "type a\n", 7) && q
+        && !mpz_set_str(gt_q, std::string(q + 3, strcspn(q + 3, "\n")).c_str(), 10)
+        && (int) (mpz_sizeinbase(gt_q, 2) + 7) / 8 <= size_GT / 2)
+        size_Fq = size_GT / 2;
+
+    fmt_set(fmt_default());
+
+    // kept for bundle_store()
+    free(param_text);
+    param_text = param;
+    param_len = count;
+    param = NULL;
+
+    CLEANUP:
+    if (param_file)
+        fclose(param_file);
+    free(param);
+    return ret;
+}
+
+// loads param_dir/<name>.param, NULL for AIBE_PROFILE
+int AibeAlgo::load_profile(const char *name) {
+    char path[256];
+
+    if (!name)
+        name = AIBE_PROFILE;
+    if (snprintf(path, sizeof(path), "%s%s.param", param_dir, name) >= (int) sizeof(path))
+        return -1;
+    return load_param(path);
+}
+
+int AibeAlgo::fmt_default() {
+    return gt_comp && size_Fq ? AIBE_FMT_GTC : 0;
+}
+
+// 0 if the mode byte of a header names a known mode with flags it is written with and the loaded
+// params can read. Plain blocks carry no header, so a block header has at least one flag; AUTH
+// with LEN is an authenticated stream.
+int AibeAlgo::fmt_check(int flags) {
+    int mode = flags & AIBE_MODE_MASK;
+
+    if ((flags & AIBE_FMT_GTC) && !size_Fq)
+        return -1;
+    if (mode == AIBE_MODE_BLOCK)
+        return (flags & ~AIBE_MODE_MASK) ? 0 : -1;
+    if (mode == AIBE_MODE_HYBRID || mode == AIBE_MODE_BCAST)
+        return (flags & (AIBE_FMT_AUTH | AIBE_FMT_LEN)) ? -1 : 0;
+    return -1;
+}
+
+// block and header sizes for the format flags of a ciphertext
+void AibeAlgo::fmt_set(int flags) {
+    int gt = (flags & AIBE_FMT_GTC) ? size_Fq : size_GT;
+
+    fmt = flags;
+    size_comp_GT = gt;
+    size_ct_block = size_comp_G1 * 2 + gt * 2;
+    // the pad stays size_GT wide with compressed c3 c4, see block_pad()
+    size_msg_block = size_GT;
+    size_block = size_msg_block + size_ct_block;
+    size_ct = BLOCK_MAX * size_block;
+    // magic, mode, A-IBE block, iv
+    size_hyb_header = sizeof(aibe_magic) + 1 + size_ct_block + DEM_IV_SIZE;
+}
+
+void AibeAlgo::gt_store(uint8_t *buf, element_t e) {
+    uint8_t buffer[ELEM_MAX];
+
+    if (!(fmt & AIBE_FMT_GTC)) {
+        element_to_bytes(buf, e);
+        return;
+    }
+    element_to_bytes(buffer, e);
+    gt_compress(buf, buffer, gt_q, size_Fq);
+}
+
+void AibeAlgo::gt_load(element_t e, uint8_t *buf) {
+    uint8_t buffer[ELEM_MAX];
+
+    if (!(fmt & AIBE_FMT_GTC)) {
+        element_from_bytes(e, (unsigned char *) buf);
+        return;
+    }
+    gt_decompress(buffer, buf, gt_q, size_Fq);
+    element_from_bytes(e, buffer);
+}
+
+void AibeAlgo::init() {
+
+    element_init_Zr(x, pairing);
+    element_init_Zr(x_inv, pairing);
+    element_init_G2(g, pairing);
+    mpk_init(&mpk, pairing);
+    element_init_GT(egh, pairing);
+    element_init_GT(egY, pairing);
+
+    element_init_G1(Hz, pairing);
+    element_init_Zr(t0, pairing);
+    element_init_Zr(theta, pairing);
+    element_init_G1(R, pairing);
+    element_init_Zr(r, pairing);
+    element_init_Zr(r2, pairing);
+    element_init_GT(el, pairing);
+    element_init_GT(er, pairing);
+    blk_ctx_init(&blk, pairing);
+
+    element_init_Zr(r1, pairing);
+    element_init_Zr(t1, pairing);
+    dk_init(&dk, pairing);
+    dk_init(&dk1, pairing);
+
+    element_init_Zr(tz, pairing);
+    element_init_G1(tg, pairing);
+    element_init_GT(te, pairing);
+    for (int i = 0; i < MP_MAX; ++i) {
+        element_init_G1(mp1[i], pairing);
+        element_init_G2(mp2[i], pairing);
+    }
+
+    fb_g.tab = fb_X.tab = fb_h.tab = NULL;
+    fb_egh.tab = fb_egY.tab = NULL;
+    hz_tab.tab = NULL;
+    dk_pp = 0;
+    backend_init();
+    if (std::max(worker_num() - 1, task_threads) > 0)
+        task_pool = task_pool_new(std::max(worker_num() - 1, task_threads), pairing);
+}
+
+// PBC, or the tpa backend for type a params once backend_check() has compared it with PBC
+void AibeAlgo::backend_init() {
+    backend_t fast;
+    backend_seen_t seen;
+    int found = 0;
+
+    backend_pbc(&backend, pairing);
+    if (!tpa || !size_Fq)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(backend_mtx);
+        for (const backend_seen_t &s : backend_seen) {
+            if (!memcmp(s.param_hash, param_hash, SHA256_DIGEST_LENGTH)) {
+                seen = s;
+                found = 1;
+                break;
+            }
+        }
+    }
+    if (found && !seen.ok)
+        return;
+    if (backend_tpa(&fast, pairing, gt_q, size_Fq))
+        return;
+    // the check runs once per param file, later instances reuse its result
+    if (!found) {
+        memcpy(seen.param_hash, param_hash, SHA256_DIGEST_LENGTH);
+        seen.ok = !backend_check(&fast);
+        std::lock_guard<std::mutex> lock(backend_mtx);
+        backend_seen.push_back(seen);
+    }
+    if (!seen.ok) {
+        fprintf(stderr, "tpa pairing differs from PBC, using PBC\n");
+        backend_clear(&fast);
+        return;
+    }
+    backend = fast;
+}
+
+// 0 if b gives the bytes of PBC for a single pairing, a product and a product over pp
+int AibeAlgo::backend_check(backend_t *b) {
+    int ret = -1;
+    element_t in1[2], in2[2], e1, e2;
+    void *pp[2] = {NULL, NULL};
+    uint8_t buf1[ELEM_MAX], buf2[ELEM_MAX];
+    int len = pairing_length_in_bytes_GT(pairing);
+
+    for (int i = 0; i < 2; ++i) {
+        element_init_G1(in1[i], pairing);
+        element_init_G1(in2[i], pairing);
+        element_random(in1[i]);
+        element_random(in2[i]);
+    }
+    element_init_GT(e1, pairing);
+    element_init_GT(e2, pairing);
+
+    element_pairing(e1, in1[0], in2[0]);
+    b->prod(b->ctx, e2, in1, in2, 1);
+    element_to_bytes(buf1, e1);
+    element_to_bytes(buf2, e2);
+    if (memcmp(buf1, buf2, len))
+        goto CLEANUP;
+
+    element_prod_pairing(e1, in1, in2, 2);
+    b->prod(b->ctx, e2, in1, in2, 2);
+    element_to_bytes(buf1, e1);
+    element_to_bytes(buf2, e2);
+    if (memcmp(buf1, buf2, len))
+        goto CLEANUP;
+
+    pp[0] = b->pp_new(b->ctx, in1[0]);
+    pp[1] = b->pp_new(b->ctx, in1[1]);
+    b->pp_prod(b->ctx, e2, pp, in2, 2);
+    element_to_bytes(buf2, e2);
+    if (memcmp(buf1, buf2, len))
+        goto CLEANUP;
+    ret = 0;
+
+    CLEANUP:
+    for (int i = 0; i < 2; ++i) {
+        if (pp[i])
+            b->pp_free(b->ctx, pp[i]);
+        element_clear(in1[i]);
+        element_clear(in2[i]);
+    }
+    element_clear(e1);
+    element_clear(e2);
+    return ret;
+}
+
+// fresh master keys, in memory only
+void AibeAlgo::setup() {
+    pools_stop();
+    elem_random(g);
+    elem_random(mpk.h);
+    elem_random(mpk.Y);
+    elem_random(x);
+    for (int i = 0; i < z_size; ++i) {
+        elem_random(mpk.Z[i]);
+    }
+    pow_fb(mpk.X, NULL, g, x);
+    msk_set();
+}
+
+void AibeAlgo::pkg_setup_generate() {
     FILE *fpk = fopen(mpk_path, "w+");
     FILE *fsk = fopen(msk_path, "w+");
 
-    element_random(g);
-    element_random(mpk.h);
-    element_random(mpk.Y);
-    element_random(x);
-    for (int i = 0; i < N; ++i) {
-        element_random(mpk.Z[i]);
-    }
-    element_pow_zn(mpk.X, g, x);
+    // a bundle of the old keys would shadow the new files
+    unlink(bundle_path);
+
+    setup();
 
-    uint8_t buffer[1024];
+    uint8_t buffer[ELEM_MAX];
 
     element_to_bytes_compressed(buffer, g);
     fwrite(buffer, size_comp_G2, 1, fpk);
@@ -313,7 +1642,7 @@ void AibeAlgo::pkg_setup_generate() {
     fwrite(buffer, size_comp_G1, 1, fpk);
     element_to_bytes_compressed(buffer, mpk.h);
     fwrite(buffer, size_comp_G1, 1, fpk);
-    for (int i = 0; i < N; ++i) {
+    for (int i = 0; i < z_size; ++i) {
         element_to_bytes_compressed(buffer, mpk.Z[i]);
         fwrite(buffer, size_comp_G1, 1, fpk);
     }
@@ -335,22 +1664,23 @@ void AibeAlgo::pkg_setup_generate() {
 }
 
 void AibeAlgo::mpk_load() {
+    pools_stop();
     FILE *fpk = fopen(mpk_path, "r+");
 
-    char buffer[1024];
+    char buffer[ELEM_MAX];
 
     fread(buffer, size_comp_G2, 1, fpk);
-    element_from_bytes_compressed(g, (unsigned char *) buffer);
+    elem_decompress(g, (unsigned char *) buffer);
     fread(buffer, size_comp_G1, 1, fpk);
-    element_from_bytes_compressed(mpk.X, (unsigned char *) buffer);
+    elem_decompress(mpk.X, (unsigned char *) buffer);
     fread(buffer, size_comp_G1, 1, fpk);
-    element_from_bytes_compressed(mpk.Y, (unsigned char *) buffer);
+    elem_decompress(mpk.Y, (unsigned char *) buffer);
     fread(buffer, size_comp_G1, 1, fpk);
-    element_from_bytes_compressed(mpk.h, (unsigned char *) buffer);
+    elem_decompress(mpk.h, (unsigned char *) buffer);
 
-    for (int i = 0; i < N; ++i) {
+    for (int i = 0; i < z_size; ++i) {
         fread(buffer, size_comp_G1, 1, fpk);
-        element_from_bytes_compressed(mpk.Z[i], (unsigned char *) buffer);
+        elem_decompress(mpk.Z[i], (unsigned char *) buffer);
     }
 
     // test
@@ -364,93 +1694,244 @@ void AibeAlgo::mpk_load() {
 //    element_printf("%B\n", x);
 
     fclose(fpk);
+
+    mpk_precompute();
+}
+
+// GT constants and tables derived from the master public key
+void AibeAlgo::mpk_precompute() {
+    // the pairing is symmetric, e(g, h) = e(h, g)
+    element_set(mp1[0], g);
+    element_set(mp2[0], mpk.h);
+    pairing_prod(egh, mp1, mp2, 1, 0);
+    element_set(mp2[0], mpk.Y);
+    pairing_prod(egY, mp1, mp2, 1, 0);
+
+    mpk_fb_init();
+    pools_start();
+}
+
+void AibeAlgo::mpk_fb_init() {
+    int bits = mpz_sizeinbase(pairing->r, 2);
+
+    mpk_fb_clear();
+    if (!fixed_base)
+        return;
+
+    fb_init(&fb_g, g, bits, FB_WINDOW);
+    fb_init(&fb_X, mpk.X, bits, FB_WINDOW);
+    fb_init(&fb_h, mpk.h, bits, FB_WINDOW);
+    fb_init(&fb_egh, egh, bits, FB_WINDOW);
+    fb_init(&fb_egY, egY, bits, FB_WINDOW);
+    hz_tab_init(&hz_tab, mpk.Z, N, HZ_WINDOW);
+}
+
+void AibeAlgo::mpk_fb_clear() {
+    fb_clear(&fb_g);
+    fb_clear(&fb_X);
+    fb_clear(&fb_h);
+    fb_clear(&fb_egh);
+    fb_clear(&fb_egY);
+    fb_clear(&hz_tab);
+}
+
+// out = base^exp, through the table of base once mpk_load() has built it; NULL fb for bases
+// without one. Counts as one exponentiation in the stats.
+void AibeAlgo::pow_fb(element_t out, fb_t *fb, element_t base, element_t exp) {
+    STAT_ADD(out->field == pairing->GT ? STAT_POW_GT : STAT_POW_G1, 1);
+    if (!fb || !fb->tab) {
+        element_pow_zn(out, base, exp);
+        return;
+    }
+
+    mpz_t z;
+    mpz_init(z);
+    element_to_mpz(z, exp);
+    fb_pow(out, fb, z);
+    mpz_clear(z);
+}
+
+// out = prod e(in1[i], in2[i]) for i < num, divided by the same product over the next den operands.
+// All Miller loops share one final exponentiation; the denominator is taken as e(in1[i]^-1, in2[i]),
+// so those in1 entries are overwritten.
+void AibeAlgo::pairing_prod(element_t out, element_t *in1, element_t *in2, int num, int den) {
+    for (int i = num; i < num + den; ++i) {
+        element_invert(in1[i], in1[i]);
+    }
+    STAT_ADD(STAT_PAIRING, num + den);
+    backend.prod(backend.ctx, out, in1, in2, num + den);
+}
+
+// Hz = Z[0] * prod Z[i] over the set bits i of id
+void AibeAlgo::hz_compute(element_t out, const aibe_id_t *id) {
+    element_set(out, mpk.Z[0]);
+    if (hz_tab.tab) {
+        hz_tab_mul(out, &hz_tab, id);
+        return;
+    }
+    for (int i = 1; i <= N; ++i) {
+        if (get_bit(id, i))
+            element_mul(out, out, mpk.Z[i]);
+    }
 }
 
 void AibeAlgo::msk_load() {
+    pools_stop();
     FILE *fsk = fopen(msk_path, "r+");
 
-    char buffer[1024];
+    char buffer[ELEM_MAX];
 
     fread(buffer, size_Zr, 1, fsk);
     element_from_bytes(x, (unsigned char *) buffer);
 
     fclose(fsk);
+    msk_set();
+    pools_start();
+}
+
+// derived msk values, once per key instead of once per request
+void AibeAlgo::msk_set() {
+    element_invert(x_inv, x);
+    msk_ready = 1;
 }
 
 // client keygen 1
-void AibeAlgo::keygen1(const int id) {
-    element_random(t0);
-    element_random(theta);
+void AibeAlgo::keygen1(const aibe_id_t *id) {
+    element_ptr pre[3] = {t0, theta, R};
+    STAT_TIME(OP_KEYGEN1);
 
-    element_set(Hz, mpk.Z[0]);
-    {
-        mpz_t digit;
-        for (int i = 1; i <= z_size; ++i) {
-            mpz_init_set_si(digit, get_bit(id, i));
-            if (!mpz_is0(digit))
-                element_mul(Hz, Hz, mpk.Z[i]);
-            mpz_clear(digit);
-        }
-    }
+    if (!kg1_pool || pool_pop(kg1_pool, pre))
+        kg1_offline(pre);
+
+    hz_compute(Hz, id);
+}
 
-    // R = h^t0 * X^theta
-    element_pow_zn(R, mpk.h, t0);
-    element_pow_zn(tg, mpk.X, theta);
-    element_mul(R, R, tg);
+// pre = t0, theta, R = h^t0 * X^theta; runs on the pool thread too, so no member temporaries
+void AibeAlgo::kg1_offline(element_ptr *pre) {
+    element_t t;
+
+    element_init_same_as(t, pre[2]);
+    elem_random(pre[0]);
+    elem_random(pre[1]);
+    pow_fb(pre[2], &fb_h, mpk.h, pre[0]);
+    pow_fb(t, &fb_X, mpk.X, pre[1]);
+    element_mul(pre[2], pre[2], t);
+    element_clear(t);
 }
 
 // pkg keygen 2
 void AibeAlgo::keygen2() {
-    element_random(r1);
-    element_random(t1);
-
-    //  d1 = (Y * _R * h^t1)^(1/x) * _Hz^r1
-    //      d1 = Y * _R
-    element_mul(dk1.d1, mpk.Y, R);
-    //      d1 = d1 * h^t1
-    element_pow_zn(tg, mpk.h, t1);
-    element_mul(dk1.d1, dk1.d1, tg);
-    //      d1 = d1 ^ (1/x)
-    element_invert(tz, x);
-    element_pow_zn(dk1.d1, dk1.d1, tz);
-    //      d1 = d1 * _Hz^r1;
-    element_pow_zn(tg, Hz, r1);
+    element_ptr pre[4] = {r1, t1, dk1.d1, dk1.d2};
+    STAT_TIME(OP_KEYGEN2);
+
+    //  d1 = (Y * _R * h^t1)^(1/x) * _Hz^r1 = (Y * h^t1)^(1/x) * _R^(1/x) * _Hz^r1
+    //      d1 = (Y * h^t1)^(1/x), d2 = X^r1
+    if (!kg2_pool || pool_pop(kg2_pool, pre))
+        kg2_offline(pre);
+    //      d1 = d1 * _R^(1/x) * _Hz^r1
+    STAT_ADD(STAT_POW_G1, 2);
+    element_pow2_zn(tg, R, x_inv, Hz, r1);
     element_mul(dk1.d1, dk1.d1, tg);
-    // d2 = X^r1
-    element_pow_zn(dk1.d2, mpk.X, r1);
     // d3 = t1
     element_set(dk1.d3, t1);
 }
 
+// keygen2 for num pending requests (Rs[i], hzs[i]) into out[i], spread over the workers. The
+// request-independent part comes from kg2_pool when it has entries.
+void AibeAlgo::keygen2_batch(element_t *Rs, element_t *hzs, int num, dk_t *out) {
+    parallel_blocks(num, [&](blk_ctx_t *, int i) { kg2_online(&out[i], Rs[i], hzs[i]); });
+}
+
+// keygen2 into out with its own temporaries, safe to run on several threads
+void AibeAlgo::kg2_online(dk_t *out, element_t R_, element_t Hz_) {
+    element_t r1_, t;
+    element_ptr pre[4] = {r1_, out->d3, out->d1, out->d2};
+    STAT_TIME(OP_KEYGEN2);
+
+    element_init_same_as(r1_, x);
+    element_init_same_as(t, out->d1);
+    // d3 = t1 straight from the precomputation
+    if (!kg2_pool || pool_pop(kg2_pool, pre))
+        kg2_offline(pre);
+    STAT_ADD(STAT_POW_G1, 2);
+    element_pow2_zn(t, R_, x_inv, Hz_, r1_);
+    element_mul(out->d1, out->d1, t);
+    element_clear(r1_);
+    element_clear(t);
+}
+
+// pre = r1, t1, (Y * h^t1)^(1/x), X^r1: the part of keygen2 that needs no request
+void AibeAlgo::kg2_offline(element_ptr *pre) {
+    elem_random(pre[0]);
+    elem_random(pre[1]);
+    pow_fb(pre[2], &fb_h, mpk.h, pre[1]);
+    element_mul(pre[2], pre[2], mpk.Y);
+    pow_fb(pre[2], NULL, pre[2], x_inv);
+    pow_fb(pre[3], &fb_X, mpk.X, pre[0]);
+}
+
 // client keygen 3
 int AibeAlgo::keygen3() {
     int ret = 0;
+    STAT_TIME(OP_KEYGEN3);
 
-    element_random(r2);
+    // dk is rewritten below
+    dk_pp_clear();
+
+    elem_random(r2);
     element_add(r, r1, r2);
+    //  d3 = d3' + t0
+    element_add(dk.d3, dk1.d3, t0);
+
+    if (task_threads > 0 && task_pool && !par_depth) {
+        // d1 and e(d1, X) | d2 and e(1/Hz, d2) | er, each task on its own operands
+        element_set(mp2[0], mpk.X);
+        element_invert(mp1[1], Hz);
+        run_tasks(3, [&](int i) {
+            if (i == 0) {
+                pow_fb(tg, &fb_g, g, theta);
+                element_div(dk.d1, dk1.d1, tg);
+                pow_fb(tg, NULL, Hz, r2);
+                element_mul(dk.d1, dk.d1, tg);
+                element_set(mp1[0], dk.d1);
+                STAT_ADD(STAT_PAIRING, 1);
+                backend.prod(backend.ctx, el, mp1, mp2, 1);
+            } else if (i == 1) {
+                pow_fb(dk.d2, &fb_X, mpk.X, r2);
+                element_mul(dk.d2, dk1.d2, dk.d2);
+                element_set(mp2[1], dk.d2);
+                STAT_ADD(STAT_PAIRING, 1);
+                backend.prod(backend.ctx, te, mp1 + 1, mp2 + 1, 1);
+            } else {
+                pow_fb(er, &fb_egh, egh, dk.d3);
+                element_mul(er, egY, er);
+            }
+        });
+        element_mul(el, el, te);
+        return element_cmp(el, er) ? -1 : 0;
+    }
+
     //  d1 = d1' / g^theta * Hz^r2
     //      d1 = d1' / g^theta
-    element_pow_zn(tg, g, theta);
+    pow_fb(tg, &fb_g, g, theta);
     element_div(dk.d1, dk1.d1, tg);
     //      d1 = d1 * Hz^r2
-    element_pow_zn(tg, Hz, r2);
+    pow_fb(tg, NULL, Hz, r2);
     element_mul(dk.d1, dk.d1, tg);
     //  d2 = d2' * X^r2
-    element_pow_zn(tg, mpk.X, r2);
+    pow_fb(tg, &fb_X, mpk.X, r2);
     element_mul(dk.d2, dk1.d2, tg);
-    //  d3 = d3' + t0
-    element_add(dk.d3, dk1.d3, t0);
 
-    //  el = e(d1, X)
-    element_pairing(el, dk.d1, mpk.X);
+    //  el = e(d1, X) / e(Hz, d2)
+    element_set(mp1[0], dk.d1);
+    element_set(mp2[0], mpk.X);
+    element_set(mp1[1], Hz);
+    element_set(mp2[1], dk.d2);
+    pairing_prod(el, mp1, mp2, 1, 1);
     //  er = e(Y, g)
-    element_pairing(er, mpk.Y, g);
+    element_set(er, egY);
     //  er = er * e(h, g)^d3
-    element_pairing(te, mpk.h, g);
-    element_pow_zn(te, te, dk.d3);
-    element_mul(er, er, te);
-    //  er = er * e(Hz, d2)
-    element_pairing(te, Hz, dk.d2);
+    pow_fb(te, &fb_egh, egh, dk.d3);
     element_mul(er, er, te);
 
     if (element_cmp(el, er)) {
@@ -459,26 +1940,134 @@ int AibeAlgo::keygen3() {
     return ret;
 }
 
-void AibeAlgo::clear() {
-    // find: element_init_([a-zA-Z0-9]*)\(([a-zA-Z0-9.\[\]]+), ([a-zA-Z]+)\)
-    // repl: element_clear($2)
+// Checks keys lo..hi-1 of bv at once: with random 64-bit d_i,
+//  e(prod d1_i^d_i, X) / prod e(Hz_i^d_i, d2_i) = e(Y, g)^sum(d_i) * e(h, g)^sum(d_i * d3_i)
+// takes one multi-pairing of hi - lo + 1 Miller loops and a single final exponentiation.
+int AibeAlgo::dk_verify_check(bv_t *bv, int lo, int hi) {
+    int ret = 0;
+    int k = hi - lo;
+    element_t e1, e3, ez;
+
+    element_init_Zr(e1, pairing);
+    element_init_Zr(e3, pairing);
+    element_init_Zr(ez, pairing);
+    element_set0(e1);
+    element_set0(e3);
+
+    element_set1(bv->in1[0]);
+    element_set(bv->in2[0], mpk.X);
+    STAT_ADD(STAT_POW_G1, 2 * k);
+    for (int i = lo; i < hi; ++i) {
+        element_pow_mpz(tg, bv->dks[i].d1, bv->delta[i]);
+        element_mul(bv->in1[0], bv->in1[0], tg);
+        element_pow_mpz(bv->in1[1 + i - lo], bv->hzs[i], bv->delta[i]);
+        element_set(bv->in2[1 + i - lo], bv->dks[i].d2);
+
+        element_set_mpz(ez, bv->delta[i]);
+        element_add(e1, e1, ez);
+        element_mul(ez, ez, bv->dks[i].d3);
+        element_add(e3, e3, ez);
+    }
+    pairing_prod(el, bv->in1, bv->in2, 1, k);
 
-    element_clear(x);
-    element_clear(g);
-    mpk_clear(&mpk);
+    pow_fb(er, &fb_egY, egY, e1);
+    pow_fb(te, &fb_egh, egh, e3);
+    element_mul(er, er, te);
 
-    element_clear(Hz);
-    element_clear(t0);
-    element_clear(theta);
-    element_clear(R);
-    element_clear(r);
-    element_clear(r2);
-    element_clear(el);
-    element_clear(er);
-    element_clear(m);
-    ct_clear(&ct);
+    if (element_cmp(el, er)) {
+        ret = -1;
+    }
 
-    element_clear(r1);
+    element_clear(e1);
+    element_clear(e3);
+    element_clear(ez);
+    return ret;
+}
+
+// bisects a failing range down to the bad keys, returns how many were found
+int AibeAlgo::dk_verify_range(bv_t *bv, int lo, int hi) {
+    int mid = lo + (hi - lo) / 2;
+
+    if (!dk_verify_check(bv, lo, hi))
+        return 0;
+    if (hi - lo == 1) {
+        bv->bad[lo] = 1;
+        return 1;
+    }
+    return dk_verify_range(bv, lo, mid) + dk_verify_range(bv, mid, hi);
+}
+
+// Verifies num keys dks[i] against the Hz of their identities hzs[i]. bad[i] is set to 1 for
+// the keys that fail and 0 otherwise; returns the number of bad keys or -1 on error.
+int AibeAlgo::dk_verify_batch(dk_t *dks, element_t *hzs, int num, int *bad) {
+    int ret = -1;
+    bv_t bv;
+
+    if (num <= 0)
+        return 0;
+
+    bv.dks = dks;
+    bv.hzs = hzs;
+    bv.bad = bad;
+    bv.delta = (mpz_t *) malloc(sizeof(mpz_t) * num);
+    bv.in1 = (element_t *) malloc(sizeof(element_t) * (num + 1));
+    bv.in2 = (element_t *) malloc(sizeof(element_t) * (num + 1));
+    if (!bv.delta || !bv.in1 || !bv.in2) {
+        free(bv.delta);
+        free(bv.in1);
+        free(bv.in2);
+        return ret;
+    }
+
+    for (int i = 0; i < num; ++i) {
+        mpz_init(bv.delta[i]);
+        pbc_mpz_randomb(bv.delta[i], BV_DELTA_BITS);
+        bad[i] = 0;
+    }
+    for (int i = 0; i <= num; ++i) {
+        element_init_G1(bv.in1[i], pairing);
+        element_init_G2(bv.in2[i], pairing);
+    }
+
+    ret = dk_verify_range(&bv, 0, num);
+
+    for (int i = 0; i < num; ++i) {
+        mpz_clear(bv.delta[i]);
+    }
+    for (int i = 0; i <= num; ++i) {
+        element_clear(bv.in1[i]);
+        element_clear(bv.in2[i]);
+    }
+    free(bv.delta);
+    free(bv.in1);
+    free(bv.in2);
+    return ret;
+}
+
+void AibeAlgo::clear() {
+    // find: element_init_([a-zA-Z0-9]*)\(([a-zA-Z0-9.\[\]]+), ([a-zA-Z]+)\)
+    // repl: element_clear($2)
+
+    pools_stop();
+
+    element_clear(x);
+    element_clear(x_inv);
+    element_clear(g);
+    mpk_clear(&mpk);
+    element_clear(egh);
+    element_clear(egY);
+
+    element_clear(Hz);
+    element_clear(t0);
+    element_clear(theta);
+    element_clear(R);
+    element_clear(r);
+    element_clear(r2);
+    element_clear(el);
+    element_clear(er);
+    blk_ctx_clear(&blk);
+
+    element_clear(r1);
     element_clear(t1);
     dk_clear(&dk);
     dk_clear(&dk1);
@@ -486,12 +2075,27 @@ void AibeAlgo::clear() {
     element_clear(tz);
     element_clear(tg);
     element_clear(te);
+    for (int i = 0; i < MP_MAX; ++i) {
+        element_clear(mp1[i]);
+        element_clear(mp2[i]);
+    }
 
+    mpk_fb_clear();
+    dk_pp_clear();
+    backend_clear(&backend);
+    task_pool_free(task_pool);
+    task_pool = NULL;
+
+    if (param_text)
+        mpz_clear(gt_q);
+    pairing_clear(pairing);
+    free(param_text);
+    param_text = NULL;
 }
 
 void AibeAlgo::dk_store() {
     FILE *f = fopen(dk_path, "w+");
-    uint8_t buffer[1024];
+    uint8_t buffer[ELEM_MAX];
 
     element_to_bytes_compressed(buffer, dk.d1);
     fwrite(buffer, size_comp_G1, 1, f);
@@ -503,136 +2107,2056 @@ void AibeAlgo::dk_store() {
     fclose(f);
 }
 
-void AibeAlgo::dk_load() {
-    FILE *f = fopen(dk_path, "r+");
-    char buffer[1024];
+// Loads dk_path into dk. With dk_id_set the key is checked against the loaded mpk first, -1 if
+// the file cannot be read or the key is not one of dk_id.
+int AibeAlgo::dk_load() {
+    if (dk_read(&dk, dk_path))
+        return -1;
+    dk_pp_init();
+    return dk_check();
+}
 
-    fread(buffer, size_comp_G1, 1, f);
-    element_from_bytes_compressed(dk.d1, (unsigned char *) buffer);
-    fread(buffer, size_comp_G1, 1, f);
-    element_from_bytes_compressed(dk.d2, (unsigned char *) buffer);
-    fread(buffer, size_Zr, 1, f);
-    element_from_bytes(dk.d3, (unsigned char *) buffer);
+// 0 if dk verifies for dk_id under the loaded mpk, or no dk_id is set
+int AibeAlgo::dk_check() {
+    int bad = 0;
+    element_t hz;
+
+    if (!dk_id_set)
+        return 0;
+    element_init_G1(hz, pairing);
+    hz_compute(hz, &dk_id);
+    if (dk_verify_batch(&dk, &hz, 1, &bad))
+        bad = 1;
+    element_clear(hz);
+    return bad ? -1 : 0;
+}
+
+// reads a key written by dk_store(), -1 if the file is missing or short
+int AibeAlgo::dk_read(dk_t *out, const char *path) {
+    int ret = -1;
+    FILE *f = fopen(path, "rb");
+    uint8_t buffer[ELEM_MAX];
 
+    if (!f)
+        return -1;
+    if (fread(buffer, size_comp_G1, 1, f) != 1)
+        goto CLEANUP;
+    elem_decompress(out->d1, buffer);
+    if (fread(buffer, size_comp_G1, 1, f) != 1)
+        goto CLEANUP;
+    elem_decompress(out->d2, buffer);
+    if (fread(buffer, size_Zr, 1, f) != 1)
+        goto CLEANUP;
+    element_from_bytes(out->d3, buffer);
+    ret = 0;
+
+    CLEANUP:
     fclose(f);
+    return ret;
+}
+
+// Re-checks stored keys at startup: reads the dk files paths[i] of identities ids[i] and verifies
+// them in one dk_verify_batch(). bad[i] is set for the keys that fail or cannot be read; returns
+// the number of bad keys or -1 on error.
+int AibeAlgo::dk_verify_files(const char *const *paths, const aibe_id_t *ids, int num, int *bad) {
+    int ret, unread = 0, k = 0;
+    std::vector<dk_t> dks(num);
+    std::vector<int> idx(num), kbad(num);
+    element_t *hzs = (element_t *) malloc(sizeof(element_t) * std::max(num, 1));
+
+    if (!hzs)
+        return -1;
+    for (int i = 0; i < num; ++i) {
+        dk_init(&dks[k], pairing);
+        element_init_G1(hzs[k], pairing);
+        bad[i] = dk_read(&dks[k], paths[i]) ? 1 : 0;
+        if (bad[i]) {
+            unread++;
+            dk_clear(&dks[k]);
+            element_clear(hzs[k]);
+            continue;
+        }
+        hz_compute(hzs[k], &ids[i]);
+        idx[k++] = i;
+    }
+
+    ret = dk_verify_batch(dks.data(), hzs, k, kbad.data());
+    for (int j = 0; j < k; ++j) {
+        if (ret > 0 && kbad[j])
+            bad[idx[j]] = 1;
+        dk_clear(&dks[j]);
+        element_clear(hzs[j]);
+    }
+    free(hzs);
+    return ret < 0 ? -1 : ret + unread;
+}
+
+// Key bundle: one file with the param text, the mpk with its GT constants, optionally the msk, the
+// decryption key and the fixed-base tables, all as uncompressed element_to_bytes() so loading needs
+// no square roots and no exponentiations. Integers are big-endian:
+//  magic(4) | version(1) | sections(1) | reserved(2) | param SHA-256 | param length(8) | param
+//  | g X Y h Z[0..N] egh egY | [x] | [d1 d2 d3] | [fb_g fb_X fb_h fb_egh fb_egY hz_tab]
+//  | SHA-256 of all bytes before it
+// a table is win(1) | rows(4) | rows << win elements.
+int AibeAlgo::bundle_store(const char *path, int sections) {
+    int ret = -1;
+    uint8_t buffer[ELEM_MAX];
+    fb_t *tabs[6] = {&fb_g, &fb_X, &fb_h, &fb_egh, &fb_egY, &hz_tab};
+    struct stat st;
+    void *map;
+    FILE *f;
+
+    if (!param_text || ((sections & BUNDLE_MSK) && !msk_ready))
+        return -1;
+    if (!fb_g.tab || !hz_tab.tab)
+        sections &= ~BUNDLE_TABLES;
+    // read back for the hash below
+    f = fopen(path, "wb+");
+    if (!f)
+        return -1;
+
+    memcpy(buffer, bundle_magic, sizeof(bundle_magic));
+    buffer[4] = BUNDLE_VERSION;
+    buffer[5] = sections;
+    buffer[6] = buffer[7] = 0;
+    if (fwrite(buffer, 8, 1, f) != 1 || fwrite(param_hash, SHA256_DIGEST_LENGTH, 1, f) != 1)
+        goto CLEANUP;
+    put_be64(buffer, param_len);
+    if (fwrite(buffer, 8, 1, f) != 1 || fwrite(param_text, param_len, 1, f) != 1)
+        goto CLEANUP;
+
+    if (elem_write(f, g) || elem_write(f, mpk.X) || elem_write(f, mpk.Y) || elem_write(f, mpk.h))
+        goto CLEANUP;
+    for (int i = 0; i < z_size; ++i) {
+        if (elem_write(f, mpk.Z[i]))
+            goto CLEANUP;
+    }
+    if (elem_write(f, egh) || elem_write(f, egY))
+        goto CLEANUP;
+    if ((sections & BUNDLE_MSK) && elem_write(f, x))
+        goto CLEANUP;
+    if ((sections & BUNDLE_DK) && (elem_write(f, dk.d1) || elem_write(f, dk.d2) || elem_write(f, dk.d3)))
+        goto CLEANUP;
+    if (sections & BUNDLE_TABLES) {
+        for (int i = 0; i < 6; ++i) {
+            if (fb_write(f, tabs[i]))
+                goto CLEANUP;
+        }
+    }
+
+    if (fflush(f) || fstat(fileno(f), &st))
+        goto CLEANUP;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(f), 0);
+    if (map == MAP_FAILED)
+        goto CLEANUP;
+    SHA256((const unsigned char *) map, st.st_size, buffer);
+    munmap(map, st.st_size);
+    if (fwrite(buffer, SHA256_DIGEST_LENGTH, 1, f) != 1)
+        goto CLEANUP;
+    ret = 0;
+
+    CLEANUP:
+    if (fclose(f))
+        ret = -1;
+    return ret;
 }
 
-void AibeAlgo::ct_store(uint8_t *buf) {
+// Maps a bundle written under the loaded param file and fills the keys and tables from it; the
+// bundle must contain the sections in need. Replaces mpk_load() and msk_load() / dk_load(), and
+// like dk_load() fails on a dk that does not verify for dk_id. Everything is read into
+// temporaries and swapped in once the whole bundle checks out: on -1 the keys, tables and pools
+// are those from before the call.
+int AibeAlgo::bundle_load(const char *path, int need) {
+    int ret = -1;
+    int sections, swapped = 0, had_pp = dk_pp, had_msk = msk_ready;
+    int bits = mpz_sizeinbase(pairing->r, 2);
+    struct stat st;
+    uint8_t *base = NULL;
+    uint8_t md[SHA256_DIGEST_LENGTH];
+    uint64_t size = 0, it = 0, len;
+    element_t g_, egh_, egY_, x_;
+    mpk_t mpk_;
+    dk_t dk_;
+    fb_t tabs_[6] = {};
+    fb_t *tabs[6] = {&fb_g, &fb_X, &fb_h, &fb_egh, &fb_egY, &hz_tab};
+    element_ptr protos[6] = {g, mpk.X, mpk.h, egh, egY, mpk.Z[0]};
+    const int tab_bits[6] = {bits, bits, bits, bits, bits, N};
+    const int tab_win[6] = {FB_WINDOW, FB_WINDOW, FB_WINDOW, FB_WINDOW, FB_WINDOW, HZ_WINDOW};
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return -1;
+    element_init_same_as(g_, g);
+    element_init_same_as(egh_, egh);
+    element_init_same_as(egY_, egY);
+    element_init_same_as(x_, x);
+    mpk_init(&mpk_, pairing);
+    dk_init(&dk_, pairing);
+
+    if (fstat(fd, &st) || st.st_size < 8 + SHA256_DIGEST_LENGTH + 8 + SHA256_DIGEST_LENGTH)
+        goto CLEANUP;
+    size = st.st_size;
+    base = (uint8_t *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        base = NULL;
+        goto CLEANUP;
+    }
+
+    // a truncated or damaged bundle fails here, before any element is parsed
+    size -= SHA256_DIGEST_LENGTH;
+    SHA256(base, size, md);
+    if (memcmp(md, base + size, SHA256_DIGEST_LENGTH))
+        goto CLEANUP;
+    if (memcmp(base, bundle_magic, sizeof(bundle_magic)) || base[4] != BUNDLE_VERSION)
+        goto CLEANUP;
+    sections = base[5];
+    if ((sections & need) != need)
+        goto CLEANUP;
+    it = 8;
+    if (memcmp(base + it, param_hash, SHA256_DIGEST_LENGTH))
+        goto CLEANUP;
+    it += SHA256_DIGEST_LENGTH;
+    len = get_be64(base + it);
+    it += 8;
+    if (len > size - it)
+        goto CLEANUP;
+    it += len;
+
+    if (elem_read(g_, base, size, &it) || elem_read(mpk_.X, base, size, &it)
+        || elem_read(mpk_.Y, base, size, &it) || elem_read(mpk_.h, base, size, &it))
+        goto CLEANUP;
+    for (int i = 0; i < z_size; ++i) {
+        if (elem_read(mpk_.Z[i], base, size, &it))
+            goto CLEANUP;
+    }
+    if (elem_read(egh_, base, size, &it) || elem_read(egY_, base, size, &it))
+        goto CLEANUP;
+    if ((sections & BUNDLE_MSK) && elem_read(x_, base, size, &it))
+        goto CLEANUP;
+    if ((sections & BUNDLE_DK) && (elem_read(dk_.d1, base, size, &it) || elem_read(dk_.d2, base, size, &it)
+                                   || elem_read(dk_.d3, base, size, &it)))
+        goto CLEANUP;
+    if (sections & BUNDLE_TABLES) {
+        for (int i = 0; i < 6; ++i) {
+            if (fb_read(&tabs_[i], protos[i], tab_bits[i], tab_win[i], base, size, &it))
+                goto CLEANUP;
+        }
+    }
+    if (it != size)
+        goto CLEANUP;
+
+    // all read, swap it in; the old values end up in the temporaries
+    pools_stop();
+    dk_pp_clear();
+    elem_swap(g, g_);
+    elem_swap(mpk.X, mpk_.X);
+    elem_swap(mpk.Y, mpk_.Y);
+    elem_swap(mpk.h, mpk_.h);
+    for (int i = 0; i < z_size; ++i) {
+        elem_swap(mpk.Z[i], mpk_.Z[i]);
+    }
+    elem_swap(egh, egh_);
+    elem_swap(egY, egY_);
+    if (sections & BUNDLE_MSK) {
+        elem_swap(x, x_);
+        msk_set();
+    }
+    if (sections & BUNDLE_DK) {
+        elem_swap(dk.d1, dk_.d1);
+        elem_swap(dk.d2, dk_.d2);
+        elem_swap(dk.d3, dk_.d3);
+    }
+    for (int i = 0; i < 6; ++i) {
+        std::swap(*tabs[i], tabs_[i]);
+    }
+    swapped = 1;
+    if (!(sections & BUNDLE_TABLES) || !fixed_base) {
+        mpk_fb_clear();
+        mpk_fb_init();
+    }
+    if (sections & BUNDLE_DK) {
+        dk_pp_init();
+        if (dk_check())
+            goto CLEANUP;
+    }
+    pools_start();
+    ret = 0;
+
+    CLEANUP:
+    if (ret && swapped) {
+        // back to the keys and tables from before the call
+        dk_pp_clear();
+        mpk_fb_clear();
+        elem_swap(g, g_);
+        elem_swap(mpk.X, mpk_.X);
+        elem_swap(mpk.Y, mpk_.Y);
+        elem_swap(mpk.h, mpk_.h);
+        for (int i = 0; i < z_size; ++i) {
+            elem_swap(mpk.Z[i], mpk_.Z[i]);
+        }
+        elem_swap(egh, egh_);
+        elem_swap(egY, egY_);
+        if (sections & BUNDLE_MSK) {
+            elem_swap(x, x_);
+            msk_ready = had_msk;
+            if (had_msk)
+                msk_set();
+        }
+        if (sections & BUNDLE_DK) {
+            elem_swap(dk.d1, dk_.d1);
+            elem_swap(dk.d2, dk_.d2);
+            elem_swap(dk.d3, dk_.d3);
+        }
+        for (int i = 0; i < 6; ++i) {
+            std::swap(*tabs[i], tabs_[i]);
+        }
+        if (had_pp)
+            dk_pp_init();
+        pools_start();
+    }
+    for (int i = 0; i < 6; ++i) {
+        fb_clear(&tabs_[i]);
+    }
+    element_clear(g_);
+    element_clear(egh_);
+    element_clear(egY_);
+    element_clear(x_);
+    mpk_clear(&mpk_);
+    dk_clear(&dk_);
+    if (base)
+        munmap(base, size + SHA256_DIGEST_LENGTH);
+    close(fd);
+    return ret;
+}
+
+void AibeAlgo::dk_pp_init() {
+    dk_pp_clear();
+    if (!dk_pp_use)
+        return;
+
+    pp_dk[0] = backend.pp_new(backend.ctx, dk.d2);
+    // block_decrypt() divides by e(d1, c1)
+    element_invert(tg, dk.d1);
+    pp_dk[1] = backend.pp_new(backend.ctx, tg);
+    dk_pp = 1;
+}
+
+void AibeAlgo::dk_pp_clear() {
+    if (!dk_pp)
+        return;
+    backend.pp_free(backend.ctx, pp_dk[0]);
+    backend.pp_free(backend.ctx, pp_dk[1]);
+    pp_dk[0] = pp_dk[1] = NULL;
+    dk_pp = 0;
+}
+
+void AibeAlgo::ct_store(blk_ctx_t *bc, uint8_t *buf) {
     int it = 0;
-    element_to_bytes_compressed(buf + it, ct.c1);
+    STAT_TIME(OP_CT_STORE);
+    element_to_bytes_compressed(buf + it, bc->ct.c1);
     it += size_comp_G1;
-    element_to_bytes_compressed(buf + it, ct.c2);
+    element_to_bytes_compressed(buf + it, bc->ct.c2);
     it += size_comp_G1;
-    element_to_bytes(buf + it, ct.c3);
-    it += size_GT;
-    element_to_bytes(buf + it, ct.c4);
-    it += size_GT;
+    gt_store(buf + it, bc->ct.c3);
+    it += size_comp_GT;
+    gt_store(buf + it, bc->ct.c4);
+    it += size_comp_GT;
 }
 
-void AibeAlgo::ct_load(uint8_t *buf) {
+void AibeAlgo::ct_load(blk_ctx_t *bc, uint8_t *buf) {
     int it = 0;
-    element_from_bytes_compressed(ct.c1, (unsigned char *) buf + it);
+    STAT_TIME(OP_CT_LOAD);
+    elem_decompress(bc->ct.c1, (unsigned char *) buf + it);
     it += size_comp_G1;
-    element_from_bytes_compressed(ct.c2, (unsigned char *) buf + it);
+    elem_decompress(bc->ct.c2, (unsigned char *) buf + it);
     it += size_comp_G1;
-    element_from_bytes(ct.c3, (unsigned char *) buf + it);
-    it += size_GT;
-    element_from_bytes(ct.c4, (unsigned char *) buf + it);
-    it += size_GT;
+    gt_load(bc->ct.c3, buf + it);
+    it += size_comp_GT;
+    gt_load(bc->ct.c4, buf + it);
+    it += size_comp_GT;
 }
 
-int AibeAlgo::block_encrypt(int id) {
-    element_t s;
-    element_init_Zr(s, pairing);
-    element_random(s);
+// pre = s, c1 = X^s, c3 = e(g, h)^s, e(g, Y)^s: the part of block_encrypt that needs no identity
+void AibeAlgo::enc_offline(element_ptr *pre) {
+    elem_random(pre[0]);
+    pow_fb(pre[1], &fb_X, mpk.X, pre[0]);
+    pow_fb(pre[2], &fb_egh, egh, pre[0]);
+    pow_fb(pre[3], &fb_egY, egY, pre[0]);
+}
 
-    element_pow_zn(ct.c1, mpk.X, s);
+int AibeAlgo::block_encrypt(blk_ctx_t *bc, const aibe_id_t *id) {
+    element_ptr pre[4] = {bc->s, bc->ct.c1, bc->ct.c3, bc->ct.c4};
+    STAT_TIME(OP_BLOCK_ENCRYPT);
 
-    element_set(Hz, mpk.Z[0]);
-    {
-        mpz_t digit;
-        for (int i = 1; i <= z_size; ++i) {
-            mpz_init_set_si(digit, get_bit(id, i));
-            if (!mpz_is0(digit))
-                element_mul(Hz, Hz, mpk.Z[i]);
-            mpz_clear(digit);
-        }
+    if (!enc_pool || pool_pop(enc_pool, pre))
+        enc_offline(pre);
+
+    hz_compute(bc->Hz, id);
+    pow_fb(bc->ct.c2, NULL, bc->Hz, bc->s);
+
+    element_mul(bc->ct.c4, bc->m, bc->ct.c4);
+
+    return 0;
+}
+
+// (re)starts the enabled pools for the loaded keys; keygen2 also needs the msk
+void AibeAlgo::pools_start() {
+    pools_stop();
+
+    if (enc_pool_cap > 0) {
+        element_ptr proto[4] = {blk.s, blk.ct.c1, blk.ct.c3, blk.ct.c4};
+        enc_pool = pool_new(proto, 4, enc_pool_cap, [this](element_ptr *pre) { enc_offline(pre); });
     }
-    element_pow_zn(ct.c2, Hz, s);
+    if (kg1_pool_cap > 0) {
+        element_ptr proto[3] = {t0, theta, R};
+        kg1_pool = pool_new(proto, 3, kg1_pool_cap, [this](element_ptr *pre) { kg1_offline(pre); });
+    }
+    if (kg2_pool_cap > 0 && msk_ready) {
+        element_ptr proto[4] = {r1, t1, dk1.d1, dk1.d2};
+        kg2_pool = pool_new(proto, 4, kg2_pool_cap, [this](element_ptr *pre) { kg2_offline(pre); });
+    }
+}
 
-    element_pairing(ct.c3, g, mpk.h);
-    element_pow_zn(ct.c3, ct.c3, s);
+void AibeAlgo::pools_stop() {
+    pool_free(enc_pool);
+    pool_free(kg1_pool);
+    pool_free(kg2_pool);
+    enc_pool = kg1_pool = kg2_pool = NULL;
+}
 
-    element_pairing(ct.c4, g, mpk.Y);
-    element_pow_zn(ct.c4, ct.c4, s);
-    element_mul(ct.c4, m, ct.c4);
+int AibeAlgo::block_decrypt(blk_ctx_t *bc) {
+    STAT_TIME(OP_BLOCK_DECRYPT);
+
+    if (task_threads > 0 && task_pool && bc == &blk && !par_depth) {
+        // e(c2, d2) | 1 / e(c1, d1) | c3^d3 side by side, m is free until the end
+        element_set(bc->mp1[0], bc->ct.c2);
+        element_set(bc->mp1[1], bc->ct.c1);
+        element_set(bc->mp2[0], dk.d2);
+        element_set(bc->mp2[1], dk.d1);
+        run_tasks(3, [&](int i) {
+            if (i == 2) {
+                pow_fb(bc->m, NULL, bc->ct.c3, dk.d3);
+            } else if (dk_pp) {
+                STAT_ADD(STAT_PAIRING, 1);
+                backend.pp_prod(backend.ctx, i ? bc->gt2 : bc->gt1, pp_dk + i, bc->mp1 + i, 1);
+            } else {
+                if (i)
+                    element_invert(bc->mp1[1], bc->mp1[1]);
+                STAT_ADD(STAT_PAIRING, 1);
+                backend.prod(backend.ctx, i ? bc->gt2 : bc->gt1, bc->mp1 + i, bc->mp2 + i, 1);
+            }
+        });
+        element_mul(bc->gt1, bc->gt1, bc->gt2);
+        element_mul(bc->gt1, bc->gt1, bc->m);
+    } else if (dk_pp) {
+        // the pairing is symmetric, e(c2, d2) / e(c1, d1) = e(d2, c2) e(1/d1, c1)
+        element_set(bc->mp1[0], bc->ct.c2);
+        element_set(bc->mp1[1], bc->ct.c1);
+        STAT_ADD(STAT_PAIRING, 2);
+        backend.pp_prod(backend.ctx, bc->gt1, pp_dk, bc->mp1, 2);
+        pow_fb(bc->gt2, NULL, bc->ct.c3, dk.d3);
+        element_mul(bc->gt1, bc->gt1, bc->gt2);
+    } else {
+        // e(c2, d2) / e(c1, d1) in one multi-pairing
+        element_set(bc->mp1[0], bc->ct.c2);
+        element_set(bc->mp2[0], dk.d2);
+        element_set(bc->mp1[1], bc->ct.c1);
+        element_set(bc->mp2[1], dk.d1);
+        pairing_prod(bc->gt1, bc->mp1, bc->mp2, 1, 1);
+        pow_fb(bc->gt2, NULL, bc->ct.c3, dk.d3);
+        element_mul(bc->gt1, bc->gt1, bc->gt2);
+    }
 
-    element_clear(s);
+    element_mul(bc->m, bc->ct.c4, bc->gt1);
 
     return 0;
 }
 
-int AibeAlgo::block_decrypt() {
+int AibeAlgo::worker_num() {
+    int n = workers > 0 ? workers : (int) std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
 
-    element_t ele_gt1;
-    element_t ele_gt2;
-    element_init_GT(ele_gt1, pairing);
-    element_init_GT(ele_gt2, pairing);
+// Runs fn(bc, i) for every block i < num, split into contiguous ranges over up to worker_num()
+// threads of the pool. Each range has its own blk_ctx_t, the calling thread takes the first with blk.
+template<typename F>
+void AibeAlgo::parallel_blocks(int num, F fn) {
+    int parts = std::min(num, worker_num());
 
-    element_pairing(ele_gt1, ct.c2, dk.d2);
-    element_pow_zn(ele_gt2, ct.c3, dk.d3);
-    element_mul(ele_gt1, ele_gt1, ele_gt2);
-    element_pairing(ele_gt2, ct.c1, dk.d1);
-    element_div(ele_gt1, ele_gt1, ele_gt2);
+    if (num <= 0)
+        return;
 
-    element_mul(m, ct.c4, ele_gt1);
+    // the blocks already keep the workers busy, block_decrypt() does not split them further
+    par_depth++;
+    run_parts(parts, [&](blk_ctx_t *bc, int t) {
+        for (int i = (int64_t) num * t / parts; i < (int64_t) num * (t + 1) / parts; ++i) {
+            fn(bc, i);
+        }
+    });
+    par_depth--;
+}
 
-    element_clear(ele_gt1);
-    element_clear(ele_gt2);
+// Runs fn(i) for every task i < num, task 0 on the calling thread and the others on up to
+// task_threads workers, and returns once all are done. Tasks share no scratch: each writes only
+// its own operands.
+template<typename F>
+void AibeAlgo::run_tasks(int num, F fn) {
+    int parts = std::min(num, task_threads + 1);
 
-    return 0;
+    run_parts(parts, [&](blk_ctx_t *, int t) {
+        for (int i = t; i < num; i += parts) {
+            fn(i);
+        }
+    });
 }
 
-int AibeAlgo::encrypt(uint8_t *ct_buf, const char *str, int id) {
+// Runs fn(bc, t) for every part t < parts, part 0 on the calling thread with blk and part t on
+// worker t - 1 with its blk_ctx_t. Runs them one after another when the pool is smaller or
+// already busy with a batch of another thread.
+template<typename F>
+void AibeAlgo::run_parts(int parts, F fn) {
+    task_pool_t *tp = task_pool;
+    std::unique_lock<std::mutex> busy;
+
+    if (tp && parts > 1 && parts <= tp->threads + 1)
+        busy = std::unique_lock<std::mutex>(tp->busy, std::try_to_lock);
+    if (!busy.owns_lock()) {
+        for (int t = 0; t < parts; ++t) {
+            fn(&blk, t);
+        }
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(tp->mtx);
+        tp->call = task_call<F>;
+        tp->arg = &fn;
+        tp->parts = parts;
+        tp->pending = parts - 1;
+        tp->gen++;
+    }
+    tp->cv.notify_all();
+    fn(&blk, 0);
+
+    std::unique_lock<std::mutex> lock(tp->mtx);
+    tp->done.wait(lock, [tp]() { return tp->pending == 0; });
+}
+
+// DEM key = SHA-256(label || m)
+void AibeAlgo::kem_key(blk_ctx_t *bc, uint8_t *key, const char *label) {
+    uint8_t buffer[ELEM_MAX];
+    int len = strlen(label);
+
+    memcpy(buffer, label, len);
+    len += element_to_bytes(buffer + len, bc->m);
+    SHA256(buffer, len, key);
+    OPENSSL_cleanse(buffer, len);
+}
+
+// The size_msg_block bytes of pad from m: the bytes of m in the plain format, SHA-256(pad_label
+// || m || counter) blocks with compressed GT, where they are uniform and just as wide.
+void AibeAlgo::block_pad(blk_ctx_t *bc, uint8_t *pad) {
+    uint8_t buffer[ELEM_MAX + 4];
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    int len = strlen(pad_label);
+
+    if (!(fmt & AIBE_FMT_GTC)) {
+        element_to_bytes(pad, bc->m);
+        return;
+    }
+    memcpy(buffer, pad_label, len);
+    len += element_to_bytes(buffer + len, bc->m);
+    for (int it = 0, ctr = 0; it < size_msg_block; it += SHA256_DIGEST_LENGTH, ++ctr) {
+        for (int i = 0; i < 4; ++i) {
+            buffer[len + i] = (uint8_t) ((uint32_t) ctr >> (24 - 8 * i));
+        }
+        SHA256(buffer, len + 4, digest);
+        memcpy(pad + it, digest, std::min(SHA256_DIGEST_LENGTH, size_msg_block - it));
+    }
+    OPENSSL_cleanse(buffer, len + 4);
+    OPENSSL_cleanse(digest, sizeof(digest));
+}
+
+// rec = (pad of m ^ msg) | c1 c2 c3 c4 for one size_msg_block block of msg
+void AibeAlgo::seal_block(blk_ctx_t *bc, uint8_t *rec, const uint8_t *msg, const aibe_id_t *id) {
+    elem_random(bc->m);
+    block_encrypt(bc, id);
+    block_pad(bc, rec);
+    data_xor(rec, msg, rec, size_msg_block);
+    ct_store(bc, rec + size_msg_block);
+}
+
+void AibeAlgo::open_block(blk_ctx_t *bc, uint8_t *msg, uint8_t *rec) {
+    ct_load(bc, rec + size_msg_block);
+    block_decrypt(bc);
+    block_pad(bc, msg);
+    data_xor(msg, msg, rec, size_msg_block);
+}
+
+// HMAC-SHA256 of the header fields and the first block record, keyed with SHA-256(auth_label || m)
+// of that block: only the dk of the header identity finds the key
+void AibeAlgo::auth_tag(uint8_t *tag, blk_ctx_t *bc, const uint8_t *hdr, const uint8_t *rec) {
+    uint8_t key[DEM_KEY_SIZE];
+    uint8_t mac[EVP_MAX_MD_SIZE];
+    unsigned int mac_len;
+    std::vector<uint8_t> buf(AUTH_FIELDS + size_block);
+
+    kem_key(bc, key, auth_label);
+    memcpy(buf.data(), hdr, AUTH_FIELDS);
+    memcpy(buf.data() + AUTH_FIELDS, rec, size_block);
+    HMAC(EVP_sha256(), key, sizeof(key), buf.data(), buf.size(), mac, &mac_len);
+    memcpy(tag, mac, AUTH_TAG_SIZE);
+    OPENSSL_cleanse(key, sizeof(key));
+}
+
+// bytes encrypt() writes for len bytes in block mode
+int AibeAlgo::block_ct_size(int len) {
+    fmt_set(fmt_default() | (block_auth ? AIBE_FMT_AUTH : 0));
+    int block_num = (len + size_msg_block - 1) / size_msg_block;
+    if (fmt & AIBE_FMT_AUTH)
+        return AUTH_HEADER_SIZE + std::max(block_num, 1) * size_block;
+    return (fmt ? sizeof(aibe_magic) + 1 : 0) + block_num * size_block;
+}
+
+int AibeAlgo::encrypt(uint8_t *ct_buf, const char *str, const aibe_id_t *id) {
     int len = strlen(str);
+
+    if (mode == AIBE_MODE_HYBRID)
+        return encrypt_hybrid(ct_buf, (const uint8_t *) str, len, id);
+    fmt_set(fmt_default() | (block_auth ? AIBE_FMT_AUTH : 0));
+    // plain blocks carry no header, other formats are announced by magic | mode
+    int it = 0;
+    if (fmt) {
+        memcpy(ct_buf, aibe_magic, sizeof(aibe_magic));
+        ct_buf[sizeof(aibe_magic)] = AIBE_MODE_BLOCK | fmt;
+        it = sizeof(aibe_magic) + 1;
+    }
     int block_num = (len % size_msg_block) ? len / size_msg_block + 1: len / size_msg_block;
-    uint8_t strbuf[block_num * size_msg_block];
+    if (fmt & AIBE_FMT_AUTH) {
+        // the tag needs a first block, an empty message gets a padding block
+        block_num = std::max(block_num, 1);
+        memcpy(ct_buf + it, id->v, ID_BYTES);
+        it += ID_BYTES;
+        for (int i = 0; i < 4; ++i) {
+            ct_buf[it++] = (uint8_t) ((uint32_t) block_num >> (24 - 8 * i));
+        }
+        memcpy(ct_buf + it, param_hash, AUTH_FP_SIZE);
+        it += AUTH_FP_SIZE + AUTH_TAG_SIZE;
+    }
+    // zero padded copy on the heap, a message of any length must not land on the stack
+    std::vector<uint8_t> strbuf((size_t) block_num * size_msg_block);
+
+    memcpy(strbuf.data(), str, len);
 
-    memset(strbuf, 0, sizeof(strbuf));
-    strcpy((char *)strbuf, str);
+    parallel_blocks(block_num, [&](blk_ctx_t *bc, int i) {
+        seal_block(bc, ct_buf + it + i * size_block, strbuf.data() + i * size_msg_block, id);
+        // block 0 is the first one of the calling thread, bc->m is still its m
+        if (i == 0 && (fmt & AIBE_FMT_AUTH))
+            auth_tag(ct_buf + AUTH_FIELDS, bc, ct_buf, ct_buf + it);
+    });
 
-    for (int i = 0; i < block_num; ++i) {
-        element_random(m);
-        block_encrypt(id);
-        element_to_bytes(ct_buf + i * size_block, m);
-        data_xor(ct_buf + i * size_block, strbuf + i * size_msg_block, ct_buf + i * size_block, size_msg_block);
-        ct_store(ct_buf + i * size_block + size_msg_block);
+    return it + block_num * size_block;
+}
+
+// hybrid header: magic | mode | c1 c2 c3 c4 | iv, encapsulating a fresh DEM key. The header
+// size depends on the format, callers size their buffers after fmt_set().
+int AibeAlgo::hyb_seal_header(uint8_t *hdr, uint8_t *key, const aibe_id_t *id) {
+    int it = 0;
+
+    memcpy(hdr + it, aibe_magic, sizeof(aibe_magic));
+    it += sizeof(aibe_magic);
+    hdr[it++] = AIBE_MODE_HYBRID | fmt;
+
+    elem_random(blk.m);
+    block_encrypt(&blk, id);
+    ct_store(&blk, hdr + it);
+    it += size_ct_block;
+    kem_key(&blk, key);
+
+    if (RAND_bytes(hdr + it, DEM_IV_SIZE) != 1)
+        return -1;
+    return 0;
+}
+
+void AibeAlgo::hyb_open_header(uint8_t *hdr, uint8_t *key) {
+    ct_load(&blk, hdr + sizeof(aibe_magic) + 1);
+    block_decrypt(&blk);
+    kem_key(&blk, key);
+}
+
+int AibeAlgo::hybrid_size(int len) {
+    fmt_set(fmt_default());
+    int chunk_num = len ? (len + DEM_CHUNK - 1) / DEM_CHUNK : 1;
+    return size_hyb_header + len + chunk_num * DEM_REC_OVERHEAD;
+}
+
+// hybrid layout: header | chunk records, see chunk_seal(); ct_buf must hold hybrid_size(len) bytes
+int AibeAlgo::encrypt_hybrid(uint8_t *ct_buf, const uint8_t *data, int len, const aibe_id_t *id) {
+    int ret;
+    int n;
+    uint8_t key[DEM_KEY_SIZE];
+    uint8_t hd[DEM_HD_SIZE];
+    uint8_t *iv;
+
+    fmt_set(fmt_default());
+    iv = ct_buf + size_hyb_header - DEM_IV_SIZE;
+    if (hyb_seal_header(ct_buf, key, id)) {
+        ret = -1;
+        goto CLEANUP;
     }
 
-    return block_num * size_block;
+    SHA256(ct_buf, size_hyb_header, hd);
+    n = chunks_seal(ct_buf + size_hyb_header, data, len, key, iv, hd);
+    ret = n < 0 ? -1 : size_hyb_header + n;
+
+    CLEANUP:
+    OPENSSL_cleanse(key, sizeof(key));
+    return ret;
 }
 
-void AibeAlgo::decrypt(uint8_t *msg, uint8_t *data, int size) {
-    int block_num = size / size_block;
+// returns the plaintext length, or -1 if a hybrid ciphertext fails authentication
+int AibeAlgo::decrypt(uint8_t *msg, uint8_t *data, int size) {
+    int it = 0;
 
-    for (int i = 0; i < block_num; ++i) {
-        ct_load(data + i * size_block + size_msg_block);
-        block_decrypt();
-        element_to_bytes(msg + i * size_msg_block, m);
-        data_xor(msg + i * size_msg_block, msg + i * size_msg_block, data + i * size_block, size_msg_block);
+    fmt_set(0);
+    if (size > (int) sizeof(aibe_magic) && !memcmp(data, aibe_magic, sizeof(aibe_magic))) {
+        int flags = data[sizeof(aibe_magic)];
+        // a header is never read as plain blocks, whatever its mode byte
+        if (fmt_check(flags))
+            return -1;
+        fmt_set(flags & ~AIBE_MODE_MASK);
+        if ((flags & AIBE_MODE_MASK) == AIBE_MODE_HYBRID)
+            return size >= size_hyb_header ? decrypt_hybrid(msg, data, size) : -1;
+        // needs the identity of the dk, see decrypt_bcast()
+        if ((flags & AIBE_MODE_MASK) == AIBE_MODE_BCAST)
+            return -1;
+        if (fmt & AIBE_FMT_AUTH)
+            return decrypt_auth(msg, data, size);
+        it = sizeof(aibe_magic) + 1;
     }
+    if (require_auth)
+        return -1;
+    int tail = (fmt & AIBE_FMT_LEN) ? STREAM_LEN_SIZE : 0;
+    data += it;
+    size -= it + tail;
+    if (size < 0 || (tail && size % size_block))
+        return -1;
+
+    int block_num = size / size_block;
 
+    parallel_blocks(block_num, [&](blk_ctx_t *bc, int i) {
+        open_block(bc, msg + i * size_msg_block, data + i * size_block);
+    });
+
+    // the stream format, see encrypt_stream_block()
+    if (tail) {
+        uint64_t len = get_be64(data + size);
+        if (len > (uint64_t) block_num * size_msg_block)
+            return -1;
+        msg[len] = '\0';
+        return (int) len;
+    }
     msg[block_num * size_msg_block] = '\0';
 
 //    printf("%s\n", msg);
+    return strlen((char *) msg);
+}
+
+// Authenticated block mode, see encrypt(). Identity, block count and param fingerprint are checked
+// before any pairing and the tag right after the first block, so a ciphertext for another key,
+// truncated or corrupted costs at most one block_decrypt().
+int AibeAlgo::decrypt_auth(uint8_t *msg, uint8_t *data, int size) {
+    int it = sizeof(aibe_magic) + 1;
+    int block_num;
+    uint8_t tag[AUTH_TAG_SIZE];
+
+    if (fmt & AIBE_FMT_LEN)
+        return decrypt_auth_stream(msg, data, size);
+    if (size < AUTH_HEADER_SIZE + size_block || (size - AUTH_HEADER_SIZE) % size_block)
+        return -1;
+    block_num = (size - AUTH_HEADER_SIZE) / size_block;
+    if (dk_id_set && memcmp(data + it, dk_id.v, ID_BYTES))
+        return -1;
+    it += ID_BYTES;
+    if (chunk_field(data + it) != (uint32_t) block_num)
+        return -1;
+    it += 4;
+    if (memcmp(data + it, param_hash, AUTH_FP_SIZE))
+        return -1;
+
+    open_block(&blk, msg, data + AUTH_HEADER_SIZE);
+    auth_tag(tag, &blk, data, data + AUTH_HEADER_SIZE);
+    if (CRYPTO_memcmp(tag, data + AUTH_FIELDS, AUTH_TAG_SIZE)) {
+        OPENSSL_cleanse(msg, size_msg_block);
+        return -1;
+    }
+    data += AUTH_HEADER_SIZE + size_block;
+
+    parallel_blocks(block_num - 1, [&](blk_ctx_t *bc, int i) {
+        open_block(bc, msg + (i + 1) * size_msg_block, data + i * size_block);
+    });
+
+    msg[block_num * size_msg_block] = '\0';
+    return strlen((char *) msg);
+}
+
+// Checks an authenticated block stream of size bytes in memory: identity and param fingerprint
+// before any pairing, then the tag with the key of the first block, which is opened into msg.
+int AibeAlgo::auth_stream_check(uint8_t *msg, uint8_t *data, uint64_t size) {
+    int it = sizeof(aibe_magic) + 1;
+    uint8_t key[DEM_KEY_SIZE];
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    uint8_t tag[AUTH_TAG_SIZE];
+
+    if (size < (uint64_t) AUTH_STREAM_HEADER_SIZE + size_block + STREAM_LEN_SIZE + AUTH_TAG_SIZE)
+        return -1;
+    if (dk_id_set && memcmp(data + it, dk_id.v, ID_BYTES))
+        return -1;
+    it += ID_BYTES;
+    if (memcmp(data + it, param_hash, AUTH_FP_SIZE))
+        return -1;
+
+    open_block(&blk, msg, data + AUTH_STREAM_HEADER_SIZE);
+    kem_key(&blk, key, auth_label);
+    SHA256(data, size - AUTH_TAG_SIZE, digest);
+    stream_tag(tag, key, digest);
+    OPENSSL_cleanse(key, sizeof(key));
+    if (CRYPTO_memcmp(tag, data + size - AUTH_TAG_SIZE, AUTH_TAG_SIZE)) {
+        OPENSSL_cleanse(msg, size_msg_block);
+        return -1;
+    }
+    return 0;
+}
+
+// An authenticated block stream read whole, see encrypt_stream_block(). Nothing past the first
+// block is opened before the tag checks out.
+int AibeAlgo::decrypt_auth_stream(uint8_t *msg, uint8_t *data, int size) {
+    int body = size - AUTH_STREAM_HEADER_SIZE - STREAM_LEN_SIZE - AUTH_TAG_SIZE;
+    int block_num;
+    uint64_t len;
+
+    if (body < size_block || body % size_block)
+        return -1;
+    block_num = body / size_block;
+    len = get_be64(data + AUTH_STREAM_HEADER_SIZE + body);
+    if (stream_blocks(len, size_msg_block, 1) != (uint64_t) block_num)
+        return -1;
+    if (auth_stream_check(msg, data, size))
+        return -1;
+    data += AUTH_STREAM_HEADER_SIZE + size_block;
+
+    parallel_blocks(block_num - 1, [&](blk_ctx_t *bc, int i) {
+        open_block(bc, msg + (i + 1) * size_msg_block, data + i * size_block);
+    });
+
+    msg[len] = '\0';
+    return (int) len;
 }
 
+int AibeAlgo::decrypt_hybrid(uint8_t *msg, uint8_t *data, int size) {
+    int ret;
+    uint8_t key[DEM_KEY_SIZE];
+    uint8_t hd[DEM_HD_SIZE];
+    uint8_t *iv = data + size_hyb_header - DEM_IV_SIZE;
+
+    hyb_open_header(data, key);
+
+    SHA256(data, size_hyb_header, hd);
+    ret = chunks_open(msg, data + size_hyb_header, size - size_hyb_header, key, iv, hd);
+    if (ret >= 0)
+        msg[ret] = '\0';
+
+    OPENSSL_cleanse(key, sizeof(key));
+    return ret;
+}
+
+// broadcast layout: magic | mode | recipient count(4) | c1 c3 c4 | count x (identity | c2) | iv
+// | chunk records. All recipients share s, so only c2 = Hz^s is per identity; the entries are
+// sorted by identity for decrypt_bcast().
+int AibeAlgo::bcast_size(int len, int num) {
+    fmt_set(fmt_default());
+    int chunk_num = len ? (len + DEM_CHUNK - 1) / DEM_CHUNK : 1;
+    return bcast_header_size(num) + len + chunk_num * DEM_REC_OVERHEAD;
+}
+
+int AibeAlgo::bcast_header_size(int num) {
+    return sizeof(aibe_magic) + 1 + 4 + size_comp_G1 + size_comp_GT * 2 + num * (ID_BYTES + size_comp_G1)
+           + DEM_IV_SIZE;
+}
+
+// ct_buf must hold bcast_size(len, num) bytes; returns the ciphertext size, or -1
+int AibeAlgo::encrypt_bcast(uint8_t *ct_buf, const uint8_t *data, int len, const aibe_id_t *ids, int num) {
+    int ret;
+    int it = 0;
+    int n;
+    uint8_t key[DEM_KEY_SIZE];
+    uint8_t hd[DEM_HD_SIZE];
+    uint8_t *ent;
+    element_ptr pre[4] = {blk.s, blk.ct.c1, blk.ct.c3, blk.ct.c4};
+    std::vector<aibe_id_t> sorted(ids, ids + num);
+
+    if (num <= 0)
+        return -1;
+    fmt_set(fmt_default());
+    std::sort(sorted.begin(), sorted.end(), [](const aibe_id_t &a, const aibe_id_t &b) {
+        return memcmp(a.v, b.v, ID_BYTES) < 0;
+    });
+
+    memcpy(ct_buf + it, aibe_magic, sizeof(aibe_magic));
+    it += sizeof(aibe_magic);
+    ct_buf[it++] = AIBE_MODE_BCAST | fmt;
+    for (int i = 0; i < 4; ++i) {
+        ct_buf[it++] = (uint8_t) ((uint32_t) num >> (24 - 8 * i));
+    }
+
+    // the identity free part once: c1 = X^s, c3 = e(g, h)^s, c4 = m * e(g, Y)^s
+    if (!enc_pool || pool_pop(enc_pool, pre))
+        enc_offline(pre);
+    elem_random(blk.m);
+    element_mul(blk.ct.c4, blk.m, blk.ct.c4);
+    element_to_bytes_compressed(ct_buf + it, blk.ct.c1);
+    it += size_comp_G1;
+    gt_store(ct_buf + it, blk.ct.c3);
+    it += size_comp_GT;
+    gt_store(ct_buf + it, blk.ct.c4);
+    it += size_comp_GT;
+    kem_key(&blk, key);
+
+    // c2 = Hz^s per recipient; the calling thread works on blk too, which leaves blk.s alone
+    ent = ct_buf + it;
+    parallel_blocks(num, [&](blk_ctx_t *bc, int i) {
+        uint8_t *e = ent + (size_t) i * (ID_BYTES + size_comp_G1);
+        memcpy(e, sorted[i].v, ID_BYTES);
+        hz_compute(bc->Hz, &sorted[i]);
+        pow_fb(bc->ct.c2, NULL, bc->Hz, blk.s);
+        element_to_bytes_compressed(e + ID_BYTES, bc->ct.c2);
+    });
+    it += num * (ID_BYTES + size_comp_G1);
+
+    if (RAND_bytes(ct_buf + it, DEM_IV_SIZE) != 1) {
+        ret = -1;
+        goto CLEANUP;
+    }
+    it += DEM_IV_SIZE;
+    SHA256(ct_buf, it, hd);
+    n = chunks_seal(ct_buf + it, data, len, key, ct_buf + it - DEM_IV_SIZE, hd);
+    ret = n < 0 ? -1 : it + n;
+
+    CLEANUP:
+    OPENSSL_cleanse(key, sizeof(key));
+    return ret;
+}
+
+// Decrypts the entry of id, the identity of the loaded dk. Returns the plaintext length, or -1 if
+// id is not a recipient or the ciphertext fails authentication.
+int AibeAlgo::decrypt_bcast(uint8_t *msg, uint8_t *data, int size, const aibe_id_t *id) {
+    int ret;
+    int it = sizeof(aibe_magic) + 1;
+    int num, lo, hi, ent_size;
+    uint8_t key[DEM_KEY_SIZE];
+    uint8_t hd[DEM_HD_SIZE];
+    uint8_t *ent = NULL;
+
+    if (size < it + 4 || memcmp(data, aibe_magic, sizeof(aibe_magic))
+        || (data[sizeof(aibe_magic)] & AIBE_MODE_MASK) != AIBE_MODE_BCAST || fmt_check(data[sizeof(aibe_magic)]))
+        return -1;
+    fmt_set(data[sizeof(aibe_magic)] & ~AIBE_MODE_MASK);
+    num = (int) chunk_field(data + it);
+    ent_size = ID_BYTES + size_comp_G1;
+    if (num <= 0 || num > (size - bcast_header_size(0)) / ent_size)
+        return -1;
+
+    // binary search of the sorted entries
+    lo = 0;
+    hi = num;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        uint8_t *e = data + bcast_header_size(0) - DEM_IV_SIZE + (size_t) mid * ent_size;
+        int c = memcmp(e, id->v, ID_BYTES);
+        if (!c) {
+            ent = e;
+            break;
+        }
+        if (c < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (!ent)
+        return -1;
+
+    it += 4;
+    elem_decompress(blk.ct.c1, data + it);
+    it += size_comp_G1;
+    gt_load(blk.ct.c3, data + it);
+    it += size_comp_GT;
+    gt_load(blk.ct.c4, data + it);
+    elem_decompress(blk.ct.c2, ent + ID_BYTES);
+    block_decrypt(&blk);
+    kem_key(&blk, key);
+
+    it = bcast_header_size(num);
+    SHA256(data, it, hd);
+    ret = chunks_open(msg, data + it, size - it, key, data + it - DEM_IV_SIZE, hd);
+    if (ret >= 0)
+        msg[ret] = '\0';
+
+    OPENSSL_cleanse(key, sizeof(key));
+    return ret;
+}
+
+// Encrypts everything readable from in to out in the current mode, holding at most one chunk
+// (hybrid) or one block (block mode) in memory. Returns the number of bytes written, or -1.
+int64_t AibeAlgo::encrypt_stream(FILE *in, FILE *out, const aibe_id_t *id, cont_index_t *idx) {
+    int64_t ret = -1;
+    int64_t total;
+    int n, last, c;
+    uint64_t seq = 0;
+    uint8_t key[DEM_KEY_SIZE];
+    uint8_t hd[DEM_HD_SIZE];
+    uint8_t *hdr = NULL, *buf = NULL, *rec = NULL;
+
+    fmt_set(fmt_default());
+    if (mode != AIBE_MODE_HYBRID)
+        return encrypt_stream_block(in, out, id, idx);
+
+    hdr = (uint8_t *) malloc(size_hyb_header);
+    buf = (uint8_t *) malloc(DEM_CHUNK);
+    rec = (uint8_t *) malloc(DEM_CHUNK + DEM_REC_OVERHEAD);
+    if (!hdr || !buf || !rec)
+        goto CLEANUP;
+
+    if (hyb_seal_header(hdr, key, id) || fwrite(hdr, size_hyb_header, 1, out) != 1)
+        goto CLEANUP;
+    SHA256(hdr, size_hyb_header, hd);
+    total = size_hyb_header;
+
+    do {
+        n = fread(buf, 1, DEM_CHUNK, in);
+        last = n < DEM_CHUNK;
+        if (!last) {
+            // only a chunk followed by EOF is marked last
+            c = fgetc(in);
+            if (c == EOF)
+                last = 1;
+            else
+                ungetc(c, in);
+        }
+        if (ferror(in))
+            goto CLEANUP;
+
+        int rec_size = chunk_seal(rec, buf, n, last, key, hdr + size_hyb_header - DEM_IV_SIZE, hd, seq++);
+        if (rec_size < 0 || fwrite(rec, rec_size, 1, out) != 1)
+            goto CLEANUP;
+        if (idx) {
+            idx->off.push_back(total);
+            idx->plain_len += n;
+        }
+        total += rec_size;
+    } while (!last);
+    ret = total;
+
+    CLEANUP:
+    OPENSSL_cleanse(key, sizeof(key));
+    free(hdr);
+    free(buf);
+    free(rec);
+    return ret;
+}
+
+// block mode: magic | mode | blocks | plaintext length, the last block is zero padded as in
+// encrypt(); reads STREAM_BATCH blocks per worker at a time and seals them in parallel. With
+// block_auth the header also holds identity and param fingerprint, as in encrypt(), and a tag
+// follows the length: HMAC-SHA256 of the SHA-256 of all bytes before it, keyed as in auth_tag()
+// with the m of the first block, which an empty stream gets as padding.
+int64_t AibeAlgo::encrypt_stream_block(FILE *in, FILE *out, const aibe_id_t *id, cont_index_t *idx) {
+    int64_t ret = -1;
+    int64_t total = 0;
+    int batch = STREAM_BATCH * worker_num();
+    int n, block_num, it;
+    uint64_t plain_len = 0, blocks = 0;
+    uint8_t key[DEM_KEY_SIZE];
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    EVP_MD_CTX *md = NULL;
+    uint8_t *msg = (uint8_t *) malloc((size_t) batch * size_msg_block);
+    uint8_t *rec = (uint8_t *) malloc((size_t) batch * size_block + AUTH_STREAM_HEADER_SIZE);
+
+    if (!msg || !rec)
+        goto CLEANUP;
+
+    fmt_set(fmt | AIBE_FMT_LEN | (block_auth ? AIBE_FMT_AUTH : 0));
+    memcpy(rec, aibe_magic, sizeof(aibe_magic));
+    rec[sizeof(aibe_magic)] = AIBE_MODE_BLOCK | fmt;
+    it = sizeof(aibe_magic) + 1;
+    if (fmt & AIBE_FMT_AUTH) {
+        memcpy(rec + it, id->v, ID_BYTES);
+        it += ID_BYTES;
+        memcpy(rec + it, param_hash, AUTH_FP_SIZE);
+        it += AUTH_FP_SIZE;
+        md = EVP_MD_CTX_new();
+        if (!md || EVP_DigestInit_ex(md, EVP_sha256(), NULL) != 1 || EVP_DigestUpdate(md, rec, it) != 1)
+            goto CLEANUP;
+    }
+    if (fwrite(rec, it, 1, out) != 1)
+        goto CLEANUP;
+    total = it;
+
+    do {
+        n = fread(msg, 1, (size_t) batch * size_msg_block, in);
+        if (ferror(in))
+            goto CLEANUP;
+        block_num = (n + size_msg_block - 1) / size_msg_block;
+        if (md && !blocks)
+            block_num = std::max(block_num, 1);
+        memset(msg + n, 0, (size_t) block_num * size_msg_block - n);
+        parallel_blocks(block_num, [&](blk_ctx_t *bc, int i) {
+            seal_block(bc, rec + (size_t) i * size_block, msg + (size_t) i * size_msg_block, id);
+            // block 0 is the first one of the calling thread, bc->m is still its m
+            if (md && !blocks && i == 0)
+                kem_key(bc, key, auth_label);
+        });
+        if (block_num && fwrite(rec, size_block, block_num, out) != (size_t) block_num)
+            goto CLEANUP;
+        if (md && EVP_DigestUpdate(md, rec, (size_t) block_num * size_block) != 1)
+            goto CLEANUP;
+        if (idx)
+            idx->plain_len += n;
+        plain_len += n;
+        blocks += block_num;
+        total += (int64_t) block_num * size_block;
+    } while (n == batch * size_msg_block);
+
+    put_be64(rec, plain_len);
+    it = STREAM_LEN_SIZE;
+    if (md) {
+        if (EVP_DigestUpdate(md, rec, STREAM_LEN_SIZE) != 1 || EVP_DigestFinal_ex(md, digest, NULL) != 1)
+            goto CLEANUP;
+        stream_tag(rec + it, key, digest);
+        it += AUTH_TAG_SIZE;
+    }
+    if (fwrite(rec, it, 1, out) != 1)
+        goto CLEANUP;
+    ret = total + it;
+
+    CLEANUP:
+    if (md)
+        OPENSSL_cleanse(key, sizeof(key));
+    EVP_MD_CTX_free(md);
+    free(msg);
+    free(rec);
+    return ret;
+}
+
+// Decrypts a container, hybrid or block-mode stream from in to out and returns the plaintext length, or -1.
+// Hybrid chunks are authenticated before they are written, the tag of an authenticated block
+// stream only at its end, and a stream rejected part way (e.g. truncated) leaves its earlier
+// chunks or blocks in out: discard the output on -1.
+int64_t AibeAlgo::decrypt_stream(FILE *in, FILE *out) {
+    uint8_t probe[sizeof(aibe_magic) + 1];
+    int n = fread(probe, 1, sizeof(probe), in);
+    int flags;
+
+    if (n == sizeof(probe) && !memcmp(probe, cont_magic, sizeof(cont_magic)))
+        return decrypt_stream_cont(in, out);
+    fmt_set(0);
+    if (n == sizeof(probe) && !memcmp(probe, aibe_magic, sizeof(aibe_magic))) {
+        flags = probe[sizeof(aibe_magic)];
+        if (fmt_check(flags))
+            return -1;
+        fmt_set(flags & ~AIBE_MODE_MASK);
+        if ((flags & AIBE_MODE_MASK) == AIBE_MODE_HYBRID)
+            return decrypt_stream_hybrid(in, out, probe);
+        // both need the whole ciphertext, see decrypt_bcast() and decrypt_auth()
+        if ((flags & AIBE_MODE_MASK) == AIBE_MODE_BCAST
+            || ((flags & AIBE_FMT_AUTH) && !(flags & AIBE_FMT_LEN)))
+            return -1;
+        if (require_auth && !(flags & AIBE_FMT_AUTH))
+            return -1;
+        return decrypt_stream_block(in, out, probe, 0);
+    }
+    if (require_auth)
+        return -1;
+    return decrypt_stream_block(in, out, probe, n);
+}
+
+int64_t AibeAlgo::decrypt_stream_hybrid(FILE *in, FILE *out, const uint8_t *probe) {
+    int64_t ret = -1;
+    int64_t total = 0;
+    int n, last = 0;
+    uint32_t field;
+    uint64_t seq = 0;
+    uint8_t key[DEM_KEY_SIZE];
+    uint8_t hd[DEM_HD_SIZE];
+    uint8_t *hdr = (uint8_t *) malloc(size_hyb_header);
+    uint8_t *buf = (uint8_t *) malloc(DEM_CHUNK);
+    uint8_t *rec = (uint8_t *) malloc(DEM_CHUNK + DEM_REC_OVERHEAD);
+
+    if (!hdr || !buf || !rec)
+        goto CLEANUP;
+
+    memcpy(hdr, probe, sizeof(aibe_magic) + 1);
+    n = size_hyb_header - sizeof(aibe_magic) - 1;
+    if (fread(hdr + sizeof(aibe_magic) + 1, 1, n, in) != (size_t) n)
+        goto CLEANUP;
+    hyb_open_header(hdr, key);
+    SHA256(hdr, size_hyb_header, hd);
+
+    while (!last) {
+        if (fread(rec, 1, 4, in) != 4)
+            goto CLEANUP;
+        field = chunk_field(rec);
+        n = field & ~DEM_LAST;
+        last = (field & DEM_LAST) != 0;
+        if (n > DEM_CHUNK || fread(rec + 4, 1, n + DEM_TAG_SIZE, in) != (size_t) n + DEM_TAG_SIZE)
+            goto CLEANUP;
+        if (chunk_open(buf, rec, n, key, hdr + size_hyb_header - DEM_IV_SIZE, hd, seq++))
+            goto CLEANUP;
+        if (n && fwrite(buf, n, 1, out) != 1)
+            goto CLEANUP;
+        total += n;
+    }
+    if (fgetc(in) != EOF)
+        goto CLEANUP;
+    ret = total;
+
+    CLEANUP:
+    OPENSSL_cleanse(key, sizeof(key));
+    free(hdr);
+    free(buf);
+    free(rec);
+    return ret;
+}
+
+// With AIBE_FMT_LEN the plaintext length after the blocks drops the padding of the last block.
+// Older streams lose their trailing zeros to it, as with the NUL terminator of decrypt(). With
+// AIBE_FMT_AUTH the header is checked before any pairing and the tag before the last batch is
+// written, see encrypt_stream_block().
+int64_t AibeAlgo::decrypt_stream_block(FILE *in, FILE *out, const uint8_t *probe, int n) {
+    int64_t ret = -1;
+    int64_t total = 0;
+    int batch = STREAM_BATCH * worker_num();
+    int auth = (fmt & AIBE_FMT_AUTH) != 0;
+    int tail = (fmt & AIBE_FMT_LEN) ? STREAM_LEN_SIZE + (auth ? AUTH_TAG_SIZE : 0) : 0;
+    size_t cap = (size_t) batch * size_block + tail;
+    size_t have, body;
+    int block_num, c, last, first;
+    uint64_t blocks = 0, len, plain_len;
+    uint8_t key[DEM_KEY_SIZE];
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    uint8_t tag[AUTH_TAG_SIZE];
+    EVP_MD_CTX *md = NULL;
+    uint8_t *rec = (uint8_t *) malloc(cap + AUTH_STREAM_HEADER_SIZE);
+    uint8_t *msg = (uint8_t *) malloc((size_t) batch * size_msg_block);
+
+    if (!rec || !msg)
+        goto CLEANUP;
+
+    if (auth) {
+        // probe holds magic | mode, n is 0
+        memcpy(rec, probe, sizeof(aibe_magic) + 1);
+        n = AUTH_STREAM_HEADER_SIZE - sizeof(aibe_magic) - 1;
+        if (fread(rec + sizeof(aibe_magic) + 1, 1, n, in) != (size_t) n)
+            goto CLEANUP;
+        if ((dk_id_set && memcmp(rec + sizeof(aibe_magic) + 1, dk_id.v, ID_BYTES))
+            || memcmp(rec + sizeof(aibe_magic) + 1 + ID_BYTES, param_hash, AUTH_FP_SIZE))
+            goto CLEANUP;
+        md = EVP_MD_CTX_new();
+        if (!md || EVP_DigestInit_ex(md, EVP_sha256(), NULL) != 1
+            || EVP_DigestUpdate(md, rec, AUTH_STREAM_HEADER_SIZE) != 1)
+            goto CLEANUP;
+        n = 0;
+    }
+    memcpy(rec, probe, n);
+    have = n + fread(rec + n, 1, cap - n, in);
+    do {
+        last = have < cap;
+        if (!last) {
+            c = fgetc(in);
+            last = c == EOF;
+            if (!last)
+                ungetc(c, in);
+        }
+        // a full batch keeps its tail bytes for the next round, they may be the length
+        body = last ? have - tail : cap - tail;
+        if (have < (size_t) tail || body % size_block)
+            goto CLEANUP;
+        block_num = body / size_block;
+        first = !blocks;
+        blocks += block_num;
+
+        parallel_blocks(block_num, [&](blk_ctx_t *bc, int i) {
+            open_block(bc, msg + (size_t) i * size_msg_block, rec + (size_t) i * size_block);
+            // block 0 is the first one of the calling thread, bc->m is still its m
+            if (auth && first && i == 0)
+                kem_key(bc, key, auth_label);
+        });
+        if (auth && EVP_DigestUpdate(md, rec, last ? body + STREAM_LEN_SIZE : body) != 1)
+            goto CLEANUP;
+        len = (uint64_t) block_num * size_msg_block;
+        if (last && tail) {
+            // only the last block may be short
+            plain_len = get_be64(rec + body);
+            if (stream_blocks(plain_len, size_msg_block, auth) != blocks)
+                goto CLEANUP;
+            if (auth) {
+                if (EVP_DigestFinal_ex(md, digest, NULL) != 1)
+                    goto CLEANUP;
+                stream_tag(tag, key, digest);
+                if (CRYPTO_memcmp(tag, rec + body + STREAM_LEN_SIZE, AUTH_TAG_SIZE))
+                    goto CLEANUP;
+            }
+            len = plain_len - total;
+        } else if (last) {
+            while (len && !msg[len - 1])
+                --len;
+        }
+        if (len && fwrite(msg, len, 1, out) != 1)
+            goto CLEANUP;
+        total += len;
+
+        if (!last) {
+            memmove(rec, rec + body, have - body);
+            have -= body;
+            have += fread(rec + have, 1, cap - have, in);
+        }
+    } while (!last);
+    if (ferror(in))
+        goto CLEANUP;
+    ret = total;
+
+    CLEANUP:
+    if (md)
+        OPENSSL_cleanse(key, sizeof(key));
+    EVP_MD_CTX_free(md);
+    free(rec);
+    free(msg);
+    return ret;
+}
+
+// Writes in as a container to out: header | payload | index. The payload is the stream of
+// encrypt_stream(); out must be seekable, the header is filled in once the index is known.
+// Block payloads get no index, see aibe_cont_t.
+int64_t AibeAlgo::encrypt_container(FILE *in, FILE *out, const aibe_id_t *id) {
+    cont_index_t idx;
+    uint8_t hdr[CONT_HEADER_SIZE];
+    uint8_t field[8];
+    int64_t n;
+    uint64_t count;
+    int hybrid = mode == AIBE_MODE_HYBRID;
+    int it = 0;
+
+    memset(hdr, 0, sizeof(hdr));
+    if (fwrite(hdr, sizeof(hdr), 1, out) != 1)
+        return -1;
+    idx.plain_len = 0;
+    n = encrypt_stream(in, out, id, &idx);
+    if (n < 0)
+        return -1;
+    count = hybrid ? idx.off.size() : stream_blocks(idx.plain_len, size_msg_block, fmt & AIBE_FMT_AUTH);
+    if (hybrid)
+        idx.off.push_back(n);
+    for (size_t i = 0; i < idx.off.size(); ++i) {
+        put_be64(field, CONT_HEADER_SIZE + idx.off[i]);
+        if (fwrite(field, sizeof(field), 1, out) != 1)
+            return -1;
+    }
+
+    memcpy(hdr + it, cont_magic, sizeof(cont_magic));
+    it += sizeof(cont_magic);
+    hdr[it++] = CONT_VERSION;
+    hdr[it++] = (hybrid ? AIBE_MODE_HYBRID : AIBE_MODE_BLOCK) | fmt;
+    it += 2;
+    memcpy(hdr + it, param_hash, SHA256_DIGEST_LENGTH);
+    it += SHA256_DIGEST_LENGTH;
+    memcpy(hdr + it, id->v, ID_BYTES);
+    it += ID_BYTES;
+    put_be64(hdr + it, count);
+    it += 8;
+    put_be64(hdr + it, idx.plain_len);
+    it += 8;
+    put_be64(hdr + it, CONT_HEADER_SIZE + n);
+    it += 8;
+    if (fseek(out, 0, SEEK_SET) || fwrite(hdr, sizeof(hdr), 1, out) != 1 || fseek(out, 0, SEEK_END))
+        return -1;
+
+    return CONT_HEADER_SIZE + n + 8 * idx.off.size();
+}
+
+// Prepares an opened container for cont_decrypt(): checks it was made under the loaded param
+// file and, when dk_id_set, for the identity of dk, selects its format and, for hybrid payloads,
+// opens the KEM header. Both checks come before any pairing. An authenticated block payload is
+// checked whole here, one block_decrypt() and a SHA-256 pass over the mapping.
+int AibeAlgo::cont_attach(aibe_cont_t *c) {
+    int flags = c->flags;
+    int auth = (flags & AIBE_FMT_AUTH) != 0;
+    uint8_t *payload = c->base + CONT_HEADER_SIZE;
+
+    if (memcmp(c->param_hash, param_hash, SHA256_DIGEST_LENGTH))
+        return -1;
+    if (dk_id_set && memcmp(c->id, dk_id.v, ID_BYTES))
+        return -1;
+    if (fmt_check(flags) || (auth && (flags & AIBE_MODE_MASK) != AIBE_MODE_BLOCK))
+        return -1;
+    if (require_auth && (flags & AIBE_MODE_MASK) == AIBE_MODE_BLOCK && !auth)
+        return -1;
+    fmt_set(flags & ~AIBE_MODE_MASK);
+    c->mode = flags & AIBE_MODE_MASK;
+
+    if (c->mode == AIBE_MODE_HYBRID) {
+        if (!c->index || !c->count || cont_off(c, 0) != (uint64_t) CONT_HEADER_SIZE + size_hyb_header)
+            return -1;
+        hyb_open_header(payload, c->key);
+        SHA256(payload, size_hyb_header, c->hd);
+        c->iv = payload + size_hyb_header - DEM_IV_SIZE;
+        c->unit_plain = DEM_CHUNK;
+    } else if (c->mode == AIBE_MODE_BLOCK) {
+        // magic | mode | blocks | plaintext length, see encrypt_stream_block()
+        uint64_t body = c->index_off - CONT_HEADER_SIZE;
+        uint64_t head = auth ? AUTH_STREAM_HEADER_SIZE : sizeof(aibe_magic) + 1;
+        uint64_t fixed = head + STREAM_LEN_SIZE + (auth ? AUTH_TAG_SIZE : 0);
+        if (c->index || !(flags & AIBE_FMT_LEN) || body < fixed
+            || memcmp(payload, aibe_magic, sizeof(aibe_magic)) || payload[sizeof(aibe_magic)] != flags
+            || (body - fixed) % size_block || (body - fixed) / size_block != c->count
+            || get_be64(payload + body - fixed + head) != c->plain_len)
+            return -1;
+        if (auth) {
+            std::vector<uint8_t> first(size_msg_block);
+            if (memcmp(payload + sizeof(aibe_magic) + 1, c->id, ID_BYTES) || auth_stream_check(first.data(), payload, body))
+                return -1;
+            OPENSSL_cleanse(first.data(), first.size());
+        }
+        c->unit_base = CONT_HEADER_SIZE + head;
+        c->unit_size = size_block;
+        c->iv = NULL;
+        c->unit_plain = size_msg_block;
+    } else {
+        return -1;
+    }
+
+    // only the last unit may be short; an empty hybrid payload is a single empty chunk, an empty
+    // authenticated block payload a single padding block
+    if ((c->mode == AIBE_MODE_HYBRID || auth) && c->count == 1 && c->plain_len == 0)
+        return 0;
+    if (c->count ? c->plain_len <= (c->count - 1) * c->unit_plain || c->plain_len > c->count * c->unit_plain
+                 : c->plain_len != 0)
+        return -1;
+    return 0;
+}
+
+// Decrypts units first .. first + num - 1 of an attached container straight from the mapping
+// into out, which holds num * unit_plain bytes. Returns the plaintext length, or -1 if a unit is
+// malformed or fails authentication.
+int64_t AibeAlgo::cont_decrypt(aibe_cont_t *c, uint64_t first, uint64_t num, uint8_t *out) {
+    std::atomic<int> failed(0);
+
+    if (first > c->count || num > c->count - first)
+        return -1;
+    // the tail length below is for ranges that end with the last unit
+    if (!num)
+        return 0;
+
+    parallel_blocks((int) num, [&](blk_ctx_t *bc, int k) {
+        uint64_t i = first + k;
+        uint8_t *rec = c->base + cont_off(c, i);
+        uint64_t len = cont_off(c, i + 1) - cont_off(c, i);
+        uint8_t *msg = out + (size_t) k * c->unit_plain;
+        int last = i + 1 == c->count;
+
+        if (c->mode == AIBE_MODE_BLOCK) {
+            if (len != (uint64_t) size_block) {
+                failed = 1;
+                return;
+            }
+            open_block(bc, msg, rec);
+            return;
+        }
+        if (len < DEM_REC_OVERHEAD) {
+            failed = 1;
+            return;
+        }
+        uint32_t field = chunk_field(rec);
+        uint64_t n = field & ~DEM_LAST;
+        if (n != len - DEM_REC_OVERHEAD || !(field & DEM_LAST) != !last
+            || n != (last ? c->plain_len - i * c->unit_plain : (uint64_t) c->unit_plain)
+            || chunk_open(msg, rec, n, c->key, c->iv, c->hd, i))
+            failed = 1;
+    });
+
+    if (failed)
+        return -1;
+    if (first + num == c->count)
+        return c->plain_len - first * c->unit_plain;
+    return num * c->unit_plain;
+}
+
+// the container behind in is mapped, not read through in
+int64_t AibeAlgo::decrypt_stream_cont(FILE *in, FILE *out) {
+    int64_t ret = -1;
+    int64_t total = 0;
+    int64_t n;
+    uint64_t batch;
+    uint8_t *buf = NULL;
+    aibe_cont_t c;
+
+    if (cont_open(&c, fileno(in)))
+        return -1;
+    if (cont_attach(&c))
+        goto CLEANUP;
+
+    batch = c.mode == AIBE_MODE_HYBRID ? worker_num() : STREAM_BATCH * worker_num();
+    buf = (uint8_t *) malloc(batch * c.unit_plain);
+    if (!buf)
+        goto CLEANUP;
+    for (uint64_t first = 0; first < c.count; first += batch) {
+        n = cont_decrypt(&c, first, c.count - first < batch ? c.count - first : batch, buf);
+        if (n < 0 || (n && fwrite(buf, n, 1, out) != 1))
+            goto CLEANUP;
+        total += n;
+    }
+    ret = total;
+
+    CLEANUP:
+    free(buf);
+    cont_close(&c);
+    return ret;
+}
+
+void mpz_to_bytes_pad(uint8_t *out, mpz_t z, int size) {
+    size_t count;
+    size_t n = (mpz_sizeinbase(z, 2) + 7) / 8;
+
+    memset(out, 0, size);
+    mpz_export(out + size - n, &count, 1, 1, 1, 0, z);
+}
+
+// Torus compression of the norm 1 subgroup of GT = F_q[i]: a + bi -> t = (1 + a) / b, and
+// 1 -> 0 (t = 0 would be -1, which has order 2). in holds a | b as written by element_to_bytes.
+void gt_compress(uint8_t *out, const uint8_t *in, mpz_t q, int size_Fq) {
+    mpz_t a, b;
+
+    mpz_init(a);
+    mpz_init(b);
+    mpz_import(a, size_Fq, 1, 1, 1, 0, in);
+    mpz_import(b, size_Fq, 1, 1, 1, 0, in + size_Fq);
+    if (mpz_sgn(b)) {
+        mpz_add_ui(a, a, 1);
+        mpz_invert(b, b, q);
+        mpz_mul(a, a, b);
+        mpz_mod(a, a, q);
+    } else {
+        mpz_set_ui(a, 0);
+    }
+    mpz_to_bytes_pad(out, a, size_Fq);
+    mpz_clear(a);
+    mpz_clear(b);
+}
+
+// a = (t^2 - 1) / (t^2 + 1), b = 2t / (t^2 + 1); t^2 + 1 != 0 as q = 3 mod 4
+void gt_decompress(uint8_t *out, const uint8_t *in, mpz_t q, int size_Fq) {
+    mpz_t t, d, a, b;
+
+    mpz_init(t);
+    mpz_init(d);
+    mpz_init(a);
+    mpz_init(b);
+    mpz_import(t, size_Fq, 1, 1, 1, 0, in);
+    mpz_mod(t, t, q);
+    if (mpz_sgn(t)) {
+        mpz_mul(d, t, t);
+        mpz_sub_ui(a, d, 1);
+        mpz_add_ui(d, d, 1);
+        mpz_invert(d, d, q);
+        mpz_mul(a, a, d);
+        mpz_mod(a, a, q);
+        mpz_mul_2exp(b, t, 1);
+        mpz_mul(b, b, d);
+        mpz_mod(b, b, q);
+    } else {
+        mpz_set_ui(a, 1);
+    }
+    mpz_to_bytes_pad(out, a, size_Fq);
+    mpz_to_bytes_pad(out + size_Fq, b, size_Fq);
+    mpz_clear(t);
+    mpz_clear(d);
+    mpz_clear(a);
+    mpz_clear(b);
+}
+
+// out may alias d1 or d2
 void data_xor(uint8_t *out, const uint8_t *d1, const uint8_t *d2, int size) {
-    uint8_t buffer[size];
     for (int i = 0; i < size; ++i) {
-        buffer[i] = d1[i] ^ d2[i];
+        out[i] = d1[i] ^ d2[i];
+    }
+}
+
+int dem_encrypt(uint8_t *out, uint8_t *tag, const uint8_t *in, int len,
+                const uint8_t *key, const uint8_t *iv, const uint8_t *aad, int aad_len) {
+    int ret = -1;
+    int outl;
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+
+    if (!ctx)
+        goto CLEANUP;
+    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL) != 1
+        || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, DEM_IV_SIZE, NULL) != 1
+        || EVP_EncryptInit_ex(ctx, NULL, NULL, key, iv) != 1)
+        goto CLEANUP;
+    if (aad_len && EVP_EncryptUpdate(ctx, NULL, &outl, aad, aad_len) != 1)
+        goto CLEANUP;
+    if (len && EVP_EncryptUpdate(ctx, out, &outl, in, len) != 1)
+        goto CLEANUP;
+    if (EVP_EncryptFinal_ex(ctx, out + len, &outl) != 1
+        || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, DEM_TAG_SIZE, tag) != 1)
+        goto CLEANUP;
+    ret = 0;
+
+    CLEANUP:
+    EVP_CIPHER_CTX_free(ctx);
+    return ret;
+}
+
+int dem_decrypt(uint8_t *out, const uint8_t *tag, const uint8_t *in, int len,
+                const uint8_t *key, const uint8_t *iv, const uint8_t *aad, int aad_len) {
+    int ret = -1;
+    int outl;
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+
+    if (!ctx || len < 0)
+        goto CLEANUP;
+    if (EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL) != 1
+        || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, DEM_IV_SIZE, NULL) != 1
+        || EVP_DecryptInit_ex(ctx, NULL, NULL, key, iv) != 1)
+        goto CLEANUP;
+    if (aad_len && EVP_DecryptUpdate(ctx, NULL, &outl, aad, aad_len) != 1)
+        goto CLEANUP;
+    if (len && EVP_DecryptUpdate(ctx, out, &outl, in, len) != 1)
+        goto CLEANUP;
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, DEM_TAG_SIZE, (void *) tag) != 1
+        || EVP_DecryptFinal_ex(ctx, out + len, &outl) != 1)
+        goto CLEANUP;
+    ret = 0;
+
+    CLEANUP:
+    EVP_CIPHER_CTX_free(ctx);
+    return ret;
+}
+
+// nonce of chunk seq = iv ^ seq, seq big-endian in the low 8 bytes
+void chunk_nonce(uint8_t *nonce, const uint8_t *iv, uint64_t seq) {
+    memcpy(nonce, iv, DEM_IV_SIZE);
+    for (int i = 0; i < 8; ++i) {
+        nonce[DEM_IV_SIZE - 1 - i] ^= (uint8_t) (seq >> (8 * i));
+    }
+}
+
+// chunk record: len | AES-256-GCM(data) | tag, len is big-endian with DEM_LAST set on the final
+// chunk. The AAD is hd | len, hd the SHA-256 of the ciphertext header: records cannot be
+// reordered, dropped or truncated, nor moved under another header.
+int chunk_seal(uint8_t *rec, const uint8_t *in, int len, int last,
+               const uint8_t *key, const uint8_t *iv, const uint8_t *hd, uint64_t seq) {
+    uint8_t nonce[DEM_IV_SIZE];
+    uint8_t aad[DEM_HD_SIZE + 4];
+    uint32_t field = (uint32_t) len | (last ? DEM_LAST : 0);
+
+    for (int i = 0; i < 4; ++i) {
+        rec[i] = (uint8_t) (field >> (24 - 8 * i));
+    }
+    memcpy(aad, hd, DEM_HD_SIZE);
+    memcpy(aad + DEM_HD_SIZE, rec, 4);
+    chunk_nonce(nonce, iv, seq);
+    if (dem_encrypt(rec + 4, rec + 4 + len, in, len, key, nonce, aad, sizeof(aad)))
+        return -1;
+    return len + DEM_REC_OVERHEAD;
+}
+
+int chunk_open(uint8_t *out, const uint8_t *rec, int len,
+               const uint8_t *key, const uint8_t *iv, const uint8_t *hd, uint64_t seq) {
+    uint8_t nonce[DEM_IV_SIZE];
+    uint8_t aad[DEM_HD_SIZE + 4];
+
+    memcpy(aad, hd, DEM_HD_SIZE);
+    memcpy(aad + DEM_HD_SIZE, rec, 4);
+    chunk_nonce(nonce, iv, seq);
+    return dem_decrypt(out, rec + 4 + len, rec + 4, len, key, nonce, aad, sizeof(aad));
+}
+
+// all of data as chunk records into out; returns the bytes written, or -1
+int chunks_seal(uint8_t *out, const uint8_t *data, int len,
+                const uint8_t *key, const uint8_t *iv, const uint8_t *hd) {
+    int it = 0;
+    uint64_t seq = 0;
+
+    do {
+        int n = len > DEM_CHUNK ? DEM_CHUNK : len;
+        int rec_size = chunk_seal(out + it, data, n, n == len, key, iv, hd, seq++);
+        if (rec_size < 0)
+            return -1;
+        it += rec_size;
+        data += n;
+        len -= n;
+    } while (len);
+    return it;
+}
+
+// the size bytes of chunk records at data, up to and including the last one; returns the
+// plaintext length, or -1 if a record fails authentication or the records do not fill size
+int chunks_open(uint8_t *msg, const uint8_t *data, int size,
+                const uint8_t *key, const uint8_t *iv, const uint8_t *hd) {
+    int it = 0;
+    int len = 0;
+    int last = 0;
+    uint64_t seq = 0;
+
+    while (!last) {
+        if (size - it < DEM_REC_OVERHEAD)
+            return -1;
+        uint32_t field = chunk_field(data + it);
+        int n = field & ~DEM_LAST;
+        last = (field & DEM_LAST) != 0;
+        if (n > DEM_CHUNK || size - it - DEM_REC_OVERHEAD < n || chunk_open(msg + len, data + it, n, key, iv, hd, seq++))
+            return -1;
+        it += n + DEM_REC_OVERHEAD;
+        len += n;
+    }
+    return it == size ? len : -1;
+}
+
+uint32_t chunk_field(const uint8_t *rec) {
+    return (uint32_t) rec[0] << 24 | (uint32_t) rec[1] << 16 | (uint32_t) rec[2] << 8 | rec[3];
+}
+
+// uncompressed element, as read back by elem_read()
+int elem_write(FILE *f, element_t e) {
+    uint8_t buffer[ELEM_MAX];
+    int n = element_to_bytes(buffer, e);
+
+    return fwrite(buffer, n, 1, f) == 1 ? 0 : -1;
+}
+
+int elem_read(element_t e, const uint8_t *base, uint64_t size, uint64_t *it) {
+    uint64_t n = element_length_in_bytes(e);
+
+    if (n > size - *it)
+        return -1;
+    element_from_bytes(e, (unsigned char *) base + *it);
+    *it += n;
+    return 0;
+}
+
+// elem_random() and elem_decompress() with their STAT_ADD()
+void elem_random(element_t e) {
+    STAT_ADD(STAT_RANDOM, 1);
+    element_random(e);
+}
+
+int elem_decompress(element_t e, unsigned char *buf) {
+    STAT_ADD(STAT_DECOMPRESS, 1);
+    return element_from_bytes_compressed(e, buf);
+}
+
+// exchanges the values of two elements of the same field without copying them
+void elem_swap(element_t a, element_t b) {
+    element_s t = *a;
+
+    *a = *b;
+    *b = t;
+}
+
+int fb_write(FILE *f, fb_t *fb) {
+    uint8_t head[5];
+
+    head[0] = fb->win;
+    for (int i = 0; i < 4; ++i) {
+        head[1 + i] = (uint8_t) ((uint32_t) fb->rows >> (24 - 8 * i));
+    }
+    if (fwrite(head, sizeof(head), 1, f) != 1)
+        return -1;
+    for (int i = 0; i < fb->rows << fb->win; ++i) {
+        if (elem_write(f, fb->tab[i]))
+            return -1;
+    }
+    return 0;
+}
+
+// a table written by fb_write(), entries shaped like proto; it must have the window and the rows
+// fb_init() or hz_tab_init() would build for bits
+int fb_read(fb_t *fb, element_t proto, int bits, int win, const uint8_t *base, uint64_t size, uint64_t *it) {
+    uint64_t n = element_length_in_bytes(proto);
+    uint64_t num;
+
+    if (size - *it < 5)
+        return -1;
+    fb->win = base[*it];
+    fb->rows = chunk_field(base + *it + 1);
+    *it += 5;
+    num = (uint64_t) fb->rows << fb->win;
+    if (fb->win != win || fb->rows != (bits + win - 1) / win || num * n > size - *it)
+        return -1;
+
+    fb->tab = (element_t *) malloc(sizeof(element_t) * num);
+    for (uint64_t i = 0; i < num; ++i) {
+        element_init_same_as(fb->tab[i], proto);
+        element_from_bytes(fb->tab[i], (unsigned char *) base + *it);
+        *it += n;
+    }
+    return 0;
+}
+
+// blocks of a block stream of plain_len bytes, an empty authenticated one has a padding block
+uint64_t stream_blocks(uint64_t plain_len, int size_msg_block, int auth) {
+    uint64_t n = plain_len / size_msg_block + (plain_len % size_msg_block != 0);
+
+    return auth && !n ? 1 : n;
+}
+
+// tag of an authenticated block stream, HMAC-SHA256 of the digest of all bytes before it
+void stream_tag(uint8_t *tag, const uint8_t *key, const uint8_t *digest) {
+    uint8_t mac[EVP_MAX_MD_SIZE];
+    unsigned int mac_len;
+
+    HMAC(EVP_sha256(), key, DEM_KEY_SIZE, digest, SHA256_DIGEST_LENGTH, mac, &mac_len);
+    memcpy(tag, mac, AUTH_TAG_SIZE);
+}
+
+void put_be64(uint8_t *p, uint64_t v) {
+    for (int i = 0; i < 8; ++i) {
+        p[i] = (uint8_t) (v >> (56 - 8 * i));
+    }
+}
+
+uint64_t get_be64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) {
+        v = v << 8 | p[i];
+    }
+    return v;
+}
+
+// file offset of unit i, i = count gives the end of the last unit
+uint64_t cont_off(const aibe_cont_t *c, uint64_t i) {
+    if (!c->index)
+        return c->unit_base + i * c->unit_size;
+    return get_be64(c->index + 8 * i);
+}
+
+// Maps a container read-only and checks its header and index. The identity and flags are not
+// interpreted here, see AibeAlgo::cont_attach().
+int cont_open(aibe_cont_t *c, int fd) {
+    struct stat st;
+    const uint8_t *p;
+    uint64_t prev;
+    int it = 0;
+
+    memset(c, 0, sizeof(*c));
+    if (fstat(fd, &st) || st.st_size < CONT_HEADER_SIZE)
+        return -1;
+    c->size = st.st_size;
+    c->base = (uint8_t *) mmap(NULL, c->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (c->base == MAP_FAILED) {
+        c->base = NULL;
+        return -1;
+    }
+    p = c->base;
+
+    if (memcmp(p + it, cont_magic, sizeof(cont_magic)))
+        goto ERROR;
+    it += sizeof(cont_magic);
+    if (p[it++] != CONT_VERSION)
+        goto ERROR;
+    c->flags = p[it++];
+    it += 2;
+    c->param_hash = p + it;
+    it += SHA256_DIGEST_LENGTH;
+    c->id = p + it;
+    it += ID_BYTES;
+    c->count = get_be64(p + it);
+    it += 8;
+    c->plain_len = get_be64(p + it);
+    it += 8;
+    c->index_off = get_be64(p + it);
+    it += 8;
+
+    if (c->index_off < CONT_HEADER_SIZE || c->index_off > c->size)
+        goto ERROR;
+    // no index, the units are laid out by cont_attach()
+    if (c->index_off == c->size)
+        return 0;
+    if ((c->size - c->index_off) % 8 || (c->size - c->index_off) / 8 != c->count + 1)
+        goto ERROR;
+    c->index = p + c->index_off;
+    prev = CONT_HEADER_SIZE;
+    for (uint64_t i = 0; i <= c->count; ++i) {
+        uint64_t off = cont_off(c, i);
+        if (off < prev || off > c->index_off)
+            goto ERROR;
+        prev = off;
+    }
+    if (prev != c->index_off)
+        goto ERROR;
+    return 0;
+
+    ERROR:
+    cont_close(c);
+    return -1;
+}
+
+void cont_close(aibe_cont_t *c) {
+    if (c->base)
+        munmap(c->base, c->size);
+    c->base = NULL;
+    OPENSSL_cleanse(c->key, sizeof(c->key));
+}
+
+// Producer of a pool: fills a scratch tuple outside the lock and queues it while there is room.
+void pool_run(pool_t *pool) {
+    alloc_thread_begin();
+    element_t *tmp = (element_t *) malloc(sizeof(element_t) * pool->width);
+    element_ptr *ptr = (element_ptr *) malloc(sizeof(element_ptr) * pool->width);
+
+    for (int i = 0; i < pool->width; ++i) {
+        element_init_same_as(tmp[i], pool->slots[i]);
+        ptr[i] = tmp[i];
+    }
+
+    std::unique_lock<std::mutex> lock(pool->mtx);
+    while (!pool->stop) {
+        if (pool->count == pool->cap) {
+            pool->cv.wait(lock);
+            continue;
+        }
+        lock.unlock();
+        pool->fill(ptr);
+        lock.lock();
+
+        element_t *slot = pool->slots + (size_t) ((pool->head + pool->count) % pool->cap) * pool->width;
+        for (int i = 0; i < pool->width; ++i) {
+            element_set(slot[i], tmp[i]);
+        }
+        pool->count++;
+    }
+    lock.unlock();
+
+    for (int i = 0; i < pool->width; ++i) {
+        element_clear(tmp[i]);
+    }
+    free(tmp);
+    free(ptr);
+    alloc_thread_end();
+}
+
+// Starts a pool of cap tuples shaped like proto; fill(out) must compute one tuple and only read
+// state that stays fixed until pool_free().
+pool_t *pool_new(element_ptr *proto, int width, int cap, std::function<void(element_ptr *)> fill) {
+    pool_t *pool = new pool_t;
+
+    pool->width = width;
+    pool->cap = cap;
+    pool->head = pool->count = pool->stop = 0;
+    pool->hits = pool->misses = 0;
+    pool->fill = fill;
+    pool->slots = (element_t *) malloc(sizeof(element_t) * cap * width);
+    for (int j = 0; j < cap; ++j) {
+        for (int i = 0; i < width; ++i) {
+            element_init_same_as(pool->slots[j * width + i], proto[i]);
+        }
+    }
+    pool->th = std::thread(pool_run, pool);
+    return pool;
+}
+
+// takes the oldest tuple into out, -1 if none is ready
+int pool_pop(pool_t *pool, element_ptr *out) {
+    std::lock_guard<std::mutex> lock(pool->mtx);
+
+    if (!pool->count) {
+        pool->misses++;
+        return -1;
+    }
+    element_t *slot = pool->slots + (size_t) pool->head * pool->width;
+    for (int i = 0; i < pool->width; ++i) {
+        element_set(out[i], slot[i]);
+    }
+    pool->head = (pool->head + 1) % pool->cap;
+    pool->count--;
+    pool->hits++;
+    pool->cv.notify_one();
+    return 0;
+}
+
+template<typename F>
+void task_call(void *arg, blk_ctx_t *bc, int part) {
+    (*(F *) arg)(bc, part);
+}
+
+task_pool_t *task_pool_new(int threads, pairing_t pairing) {
+    task_pool_t *tp = new task_pool_t;
+
+    tp->threads = threads;
+    tp->stop = tp->parts = tp->pending = 0;
+    tp->gen = 0;
+    tp->call = NULL;
+    tp->arg = NULL;
+    tp->pairing = pairing;
+    for (int h = 0; h < threads; ++h) {
+        tp->th.emplace_back(task_pool_run, tp, h);
+    }
+    return tp;
+}
+
+void task_pool_run(task_pool_t *tp, int h) {
+    uint64_t seen = 0;
+    blk_ctx_t bc;
+
+    alloc_thread_begin();
+    blk_ctx_init(&bc, tp->pairing);
+    std::unique_lock<std::mutex> lock(tp->mtx);
+    while (1) {
+        tp->cv.wait(lock, [tp, &seen]() { return tp->stop || tp->gen != seen; });
+        if (tp->stop)
+            break;
+        seen = tp->gen;
+        if (h + 1 >= tp->parts)
+            continue;
+        lock.unlock();
+        tp->call(tp->arg, &bc, h + 1);
+        lock.lock();
+        if (--tp->pending == 0)
+            tp->done.notify_one();
+    }
+    lock.unlock();
+    blk_ctx_clear(&bc);
+    alloc_thread_end();
+}
+
+void task_pool_free(task_pool_t *tp) {
+    if (!tp)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(tp->mtx);
+        tp->stop = 1;
+    }
+    tp->cv.notify_all();
+    for (auto &th : tp->th) {
+        th.join();
+    }
+    delete tp;
+}
+
+void pool_free(pool_t *pool) {
+    if (!pool)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(pool->mtx);
+        pool->stop = 1;
+    }
+    pool->cv.notify_one();
+    pool->th.join();
+
+    for (int i = 0; i < pool->cap * pool->width; ++i) {
+        element_clear(pool->slots[i]);
     }
-    memcpy_s(out, size, buffer, size);
+    free(pool->slots);
+    delete pool;
 }
 
 #endif //PBC_TEST_AIBE_H
@@ -0,0 +1,219 @@
+//
+// Crypto daemon: keeps the loaded keys, tables and pools of an AibeAlgo and serves requests of
+// local processes over a Unix-domain socket
+//
+// request:  op(1) | reserved(3) | payload length(4) | payload
+// response: status(1) | reserved(3) | payload length(4) | payload
+// integers are big-endian. A connection carries any number of requests, served in order.
+//
+//   DAEMON_ENCRYPT  identity (aibe_id_t) | plaintext  ->  hybrid ciphertext
+//   DAEMON_DECRYPT  ciphertext                        ->  plaintext, block mode only with the
+//                                                         authenticated header (require_auth)
+//   DAEMON_KEYGEN   -                                 ->  -, fetches a new dk from the PKG
+//   DAEMON_QUIT     -                                 ->  -, stops the daemon
+//   DAEMON_STATS    -                                 ->  aibe_stats_print() text of the counters
+//
+
+#ifndef PBC_TEST_DAEMON_H
+#define PBC_TEST_DAEMON_H
+
+#include "aibe.h"
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define DAEMON_ENCRYPT 1
+#define DAEMON_DECRYPT 2
+#define DAEMON_KEYGEN 3
+#define DAEMON_QUIT 4
+#define DAEMON_STATS 5
+
+#define DAEMON_OK 0
+#define DAEMON_ERR 1 // malformed request or failed operation
+#define DAEMON_NOKEY 2 // no dk loaded
+
+#define DAEMON_HEADER 8
+#define DAEMON_MAX (16 << 20)
+
+const char daemon_path[] = "aibe.sock";
+
+int daemon_read(int fd, uint8_t *buf, size_t n);
+
+int daemon_write(int fd, const uint8_t *buf, size_t n);
+
+int daemon_reply(int fd, int status, const uint8_t *data, uint32_t len);
+
+int daemon_conn(AibeAlgo *aibe, int fd, int *have_dk, std::function<int()> keygen);
+
+int daemon_run(AibeAlgo *aibe, const char *path, int have_dk, std::function<int()> keygen);
+
+
+// 0 once n bytes are read, -1 on error or end of stream
+int daemon_read(int fd, uint8_t *buf, size_t n) {
+    while (n) {
+        ssize_t r = read(fd, buf, n);
+        if (r <= 0)
+            return -1;
+        buf += r;
+        n -= r;
+    }
+    return 0;
+}
+
+int daemon_write(int fd, const uint8_t *buf, size_t n) {
+    while (n) {
+        ssize_t r = send(fd, buf, n, MSG_NOSIGNAL);
+        if (r <= 0)
+            return -1;
+        buf += r;
+        n -= r;
+    }
+    return 0;
+}
+
+int daemon_reply(int fd, int status, const uint8_t *data, uint32_t len) {
+    uint8_t head[DAEMON_HEADER] = {0};
+
+    head[0] = status;
+    for (int i = 0; i < 4; ++i) {
+        head[4 + i] = (uint8_t) (len >> (24 - 8 * i));
+    }
+    if (daemon_write(fd, head, sizeof(head)))
+        return -1;
+    return len ? daemon_write(fd, data, len) : 0;
+}
+
+// Serves the requests of one connection. Returns 1 after DAEMON_QUIT, 0 when the peer closed the
+// connection, -1 on a broken connection or an oversized request.
+int daemon_conn(AibeAlgo *aibe, int fd, int *have_dk, std::function<int()> keygen) {
+    int ret = -1;
+    uint8_t head[DAEMON_HEADER];
+    std::vector<uint8_t> req, resp;
+
+    while (1) {
+        uint32_t len;
+        int n;
+
+        if (daemon_read(fd, head, sizeof(head))) {
+            ret = 0;
+            break;
+        }
+        len = chunk_field(head + 4);
+        if (len > DAEMON_MAX)
+            break;
+        req.resize(len + 1);
+        if (len && daemon_read(fd, req.data(), len))
+            break;
+
+        switch (head[0]) {
+            case DAEMON_ENCRYPT:
+                if (len < ID_BYTES) {
+                    n = daemon_reply(fd, DAEMON_ERR, NULL, 0);
+                    break;
+                }
+                resp.resize(aibe->hybrid_size(len - ID_BYTES));
+                n = aibe->encrypt_hybrid(resp.data(), req.data() + ID_BYTES, len - ID_BYTES,
+                                         (const aibe_id_t *) req.data());
+                n = n < 0 ? daemon_reply(fd, DAEMON_ERR, NULL, 0) : daemon_reply(fd, DAEMON_OK, resp.data(), n);
+                break;
+
+            case DAEMON_DECRYPT:
+                if (!*have_dk) {
+                    n = daemon_reply(fd, DAEMON_NOKEY, NULL, 0);
+                    break;
+                }
+                // decrypt() writes a terminating 0 after the plaintext
+                resp.resize(len + 1);
+                n = aibe->decrypt(resp.data(), req.data(), len);
+                n = n < 0 ? daemon_reply(fd, DAEMON_ERR, NULL, 0) : daemon_reply(fd, DAEMON_OK, resp.data(), n);
+                break;
+
+            case DAEMON_KEYGEN:
+                if (keygen()) {
+                    n = daemon_reply(fd, DAEMON_ERR, NULL, 0);
+                    break;
+                }
+                *have_dk = 1;
+                n = daemon_reply(fd, DAEMON_OK, NULL, 0);
+                break;
+
+            case DAEMON_STATS: {
+                aibe_stats_t st;
+                char *text = NULL;
+                size_t size = 0;
+                FILE *out = open_memstream(&text, &size);
+                if (!out) {
+                    n = daemon_reply(fd, DAEMON_ERR, NULL, 0);
+                    break;
+                }
+                aibe_stats(&st);
+                aibe_stats_print(out, &st);
+                fclose(out);
+                n = daemon_reply(fd, DAEMON_OK, (const uint8_t *) text, size);
+                free(text);
+                break;
+            }
+
+            case DAEMON_QUIT:
+                daemon_reply(fd, DAEMON_OK, NULL, 0);
+                return 1;
+
+            default:
+                n = daemon_reply(fd, DAEMON_ERR, NULL, 0);
+        }
+        if (n)
+            break;
+    }
+    return ret;
+}
+
+// Listens on path (mode 0600) and serves one connection at a time until DAEMON_QUIT. Requests run
+// one after another on the one AibeAlgo, the block work of each still spreads over its workers.
+int daemon_run(AibeAlgo *aibe, const char *path, int have_dk, std::function<int()> keygen) {
+    int ret = -1;
+    int fd;
+    mode_t mask;
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    // ciphertexts come from other processes: no pairing work for unauthenticated blocks
+    aibe->require_auth = 1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    unlink(path);
+    // owner only from the start, not after a chmod
+    mask = umask(0077);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+        umask(mask);
+        goto CLEANUP;
+    }
+    umask(mask);
+    if (listen(fd, 16))
+        goto CLEANUP;
+
+    while (1) {
+        int conn = accept(fd, NULL, NULL);
+        if (conn < 0 && (errno == EINTR || errno == ECONNABORTED))
+            continue;
+        if (conn < 0)
+            goto CLEANUP;
+        int quit = daemon_conn(aibe, conn, &have_dk, keygen);
+        close(conn);
+        if (quit == 1)
+            break;
+    }
+    ret = 0;
+
+    CLEANUP:
+    close(fd);
+    unlink(path);
+    return ret;
+}
+
+#endif //PBC_TEST_DAEMON_H
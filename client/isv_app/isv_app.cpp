@@ -60,6 +60,8 @@
 // Needed to calculate keys
 
 #include "aibe.h"
+#include "profile.h"
+#include "daemon.h"
 
 #define LENOFMSE 1024
 
@@ -82,7 +84,7 @@
 #define ENCLAVE_PATH "isv_enclave.signed.so"
 
 
-int client_keygen(int id, AibeAlgo aibeAlgo, sgx_enclave_id_t enclave_id, FILE *OUTPUT, NetworkClient client) {
+int client_keygen(const aibe_id_t *id, AibeAlgo &aibeAlgo, sgx_enclave_id_t enclave_id, FILE *OUTPUT, NetworkClient client) {
     int ret = 0;
     sgx_status_t status = SGX_SUCCESS;
     ra_samp_request_header_t *p_request = NULL;
@@ -189,7 +191,7 @@ int client_keygen(int id, AibeAlgo aibeAlgo, sgx_enclave_id_t enclave_id, FILE *
 #define _T(x) x
 
 
-int client_keyreq(NetworkClient client) {
+int client_keyreq(const aibe_id_t *id, NetworkClient client) {
 
     int ret = 0;
     sgx_status_t status = SGX_SUCCESS;
@@ -200,11 +202,11 @@ int client_keyreq(NetworkClient client) {
     int data_size;
     int msg_size;
 
-    msg_size = sizeof(int);
+    msg_size = sizeof(aibe_id_t);
     p_request = (ra_samp_request_header_t *) malloc(sizeof(ra_samp_request_header_t) + msg_size);
     p_request->size = msg_size;
     p_request->type = TYPE_LM_KEYREQ;
-    *((int *) p_request->body) = ID;
+    memcpy(p_request->body, id->v, sizeof(aibe_id_t));
 
     memset(client.sendbuf, 0, BUFSIZ);
     memcpy_s(client.sendbuf, BUFSIZ, p_request, sizeof(ra_samp_request_header_t) + msg_size);
@@ -247,20 +249,24 @@ int main(int argc, char *argv[]) {
     int mod = 0;
     int launch_token_update = 0;
     sgx_launch_token_t launch_token = {0};
-    FILE *f;
-    int ct_size, msg_size;
+    FILE *fin, *fout;
+    int64_t ct_size, msg_size;
+    int have_dk;
+    aibe_id_t id;
 
     //aibe load_param
     pairing_t pairing;
 
+    // before the first GMP / PBC allocation
+    alloc_install();
+    alloc_thread_begin();
+
 ////    aibe load_param
-    if (aibeAlgo.load_param(param_path)) {
+    if (aibeAlgo.load_profile(getenv("AIBE_PROFILE"))) {
         fprintf(stderr, "Param File Path error\n");
         exit(-1);
     }
 //    printf("%d, %d, %d\n", aibeAlgo.size_GT, aibeAlgo.size_comp_G1, aibeAlgo.size_Zr);
-    uint8_t ct_buf[aibeAlgo.size_ct + 10];
-    uint8_t msg_buf[aibeAlgo.size_ct + 10];
     fprintf(OUTPUT, "A-IBE Success Set Up\n");
 ////    element init
     aibeAlgo.init();
@@ -298,8 +304,14 @@ int main(int argc, char *argv[]) {
            "2) key generation\n"
            "3) block_encrypt\n"
            "4) block_decrypt\n"
+           "5) param profile benchmark\n"
+           "6) crypto daemon\n"
            "Please input a number:");
     scanf("%d", &mod);
+    id_hash(&id, ID);
+    // every dk of this client is for ID
+    aibeAlgo.dk_id = id;
+    aibeAlgo.dk_id_set = 1;
 
     switch (mod) {
         case 1:
@@ -308,7 +320,7 @@ int main(int argc, char *argv[]) {
                 ret = -1;
                 goto CLEANUP;
             }
-            client_keyreq(client);
+            client_keyreq(&id, client);
             puts("Key request finished\n");
             break;
 
@@ -328,54 +340,128 @@ int main(int argc, char *argv[]) {
             aibeAlgo.mpk_load();
             puts("Client: setup finished");
 ////    aibe: keygen
-            if (client_keygen(ID, aibeAlgo, enclave_id, OUTPUT, client)) {
+            if (client_keygen(&id, aibeAlgo, enclave_id, OUTPUT, client)) {
                 fprintf(stderr, "Key verify failed\n");
                 goto CLEANUP;
             }
             aibeAlgo.dk_store();
+            aibeAlgo.dk_pp_init();
+            // later runs map this instead of parsing mpk and dk and rebuilding the tables
+            if (aibeAlgo.bundle_store(bundle_path, BUNDLE_DK | BUNDLE_TABLES))
+                fprintf(stderr, "Write %s failed\n", bundle_path);
             fprintf(OUTPUT, "A-IBE Success Keygen \n");
 
             break;
 
         case 3:
-            aibeAlgo.mpk_load();
+            if (aibeAlgo.bundle_load(bundle_path, 0))
+                aibeAlgo.mpk_load();
             puts("Client: setup finished");
             fprintf(OUTPUT, "Start Encrypt\n");
-            f = fopen(msg_path, "r+");
-            msg_size = fread(msg_buf, sizeof(uint8_t), aibeAlgo.size_ct, f);
-            fclose(f);
-
-            fprintf(OUTPUT, "Message:\n%s\n", msg_buf);
-            fprintf(OUTPUT, "Message size: %d\n", msg_size);
-
-
-            ct_size = aibeAlgo.encrypt(ct_buf, (char *)msg_buf, ID);
-            f = fopen(ct_path, "w+");
-            fwrite(ct_buf, ct_size, 1, f);
-            fclose(f);
-
-            fprintf(OUTPUT, "encrypt size: %d, block size %d\n", ct_size, aibeAlgo.size_block);
+            fin = fopen(msg_path, "rb");
+            fout = fopen(ct_path, "wb");
+            if (!fin || !fout) {
+                fprintf(stderr, "Open %s or %s failed\n", msg_path, ct_path);
+                ret = -1;
+            } else {
+                ct_size = aibeAlgo.encrypt_container(fin, fout, &id);
+                if (ct_size < 0) {
+                    fprintf(stderr, "Encrypt failed\n");
+                    ret = -1;
+                } else {
+                    fprintf(OUTPUT, "encrypt size: %lld, block size %d\n", (long long) ct_size, aibeAlgo.size_block);
+                }
+            }
+            if (fin)
+                fclose(fin);
+            if (fout)
+                fclose(fout);
 
             break;
 
         case 4:
-            aibeAlgo.dk_load();
-            aibeAlgo.mpk_load();
+            if (aibeAlgo.bundle_load(bundle_path, BUNDLE_DK)) {
+                // dk_load() verifies the key against the mpk
+                aibeAlgo.mpk_load();
+                if (aibeAlgo.dk_load()) {
+                    fprintf(stderr, "Load %s failed, key does not verify\n", dk_path);
+                    ret = -1;
+                    goto CLEANUP;
+                }
+            }
             puts("Client: setup finished");
             fprintf(OUTPUT, "Start Decrypt\n");
 
-            f = fopen(ct_path, "r+");
-            ct_size = fread(ct_buf, sizeof(uint8_t), aibeAlgo.size_ct, f);
-            fclose(f);
-            fprintf(OUTPUT, "decrypt size: %d, ct size: %d\n", ct_size, aibeAlgo.size_ct);
+            fin = fopen(ct_path, "rb");
+            fout = fopen(out_path, "wb");
+            if (!fin || !fout) {
+                fprintf(stderr, "Open %s or %s failed\n", ct_path, out_path);
+                ret = -1;
+            } else {
+                msg_size = aibeAlgo.decrypt_stream(fin, fout);
+                if (msg_size < 0) {
+                    // drop whatever was written before the stream was rejected
+                    fprintf(stderr, "Decrypt failed, ciphertext rejected\n");
+                    fflush(fout);
+                    if (ftruncate(fileno(fout), 0))
+                        fprintf(stderr, "Truncate %s failed\n", out_path);
+                    ret = -1;
+                } else {
+                    fprintf(OUTPUT, "decrypt size: %lld\n", (long long) msg_size);
+                }
+            }
+            if (fin)
+                fclose(fin);
+            if (fout)
+                fclose(fout);
 
-            aibeAlgo.decrypt(msg_buf, ct_buf, ct_size);
-            printf("%s\n", msg_buf);
+            break;
 
-            f = fopen(out_path, "w+");
-            fwrite(msg_buf, strlen((char *)msg_buf), 1, f);
-            fclose(f);
+        case 5:
+            if (profile_bench_all(OUTPUT, PROFILE_ITER)) {
+                fprintf(stderr, "Open %s failed\n", param_dir);
+                ret = -1;
+            }
+            break;
 
+        case 6:
+            // keys, tables and pools stay loaded for every request
+            have_dk = !aibeAlgo.bundle_load(bundle_path, BUNDLE_DK);
+            if (!have_dk) {
+                aibeAlgo.mpk_load();
+                have_dk = access(dk_path, R_OK) == 0;
+                if (have_dk && aibeAlgo.dk_load()) {
+                    fprintf(stderr, "Load %s failed, key does not verify\n", dk_path);
+                    have_dk = 0;
+                }
+            }
+            fprintf(OUTPUT, "Serving on %s\n", getenv("AIBE_SOCKET") ? getenv("AIBE_SOCKET") : daemon_path);
+            fflush(OUTPUT);
+            ret = daemon_run(&aibeAlgo, getenv("AIBE_SOCKET") ? getenv("AIBE_SOCKET") : daemon_path, have_dk,
+                             [&]() -> int {
+                NetworkClient pkg;
+                int r;
+
+                if (pkg.client("127.0.0.1", pkg_port) != 0)
+                    return -1;
+                r = remote_attestation(enclave_id, pkg) != SGX_SUCCESS
+                    || client_keygen(&id, aibeAlgo, enclave_id, OUTPUT, pkg) ? -1 : 0;
+                terminate(pkg);
+                pkg.Cleanupsocket();
+                if (r) {
+                    // back to the stored dk, keygen3 may have overwritten it
+                    if (access(dk_path, R_OK) == 0)
+                        aibeAlgo.dk_load();
+                    return -1;
+                }
+                aibeAlgo.dk_store();
+                aibeAlgo.dk_pp_init();
+                if (aibeAlgo.bundle_store(bundle_path, BUNDLE_DK | BUNDLE_TABLES))
+                    fprintf(stderr, "Write %s failed\n", bundle_path);
+                return 0;
+            });
+            if (ret)
+                fprintf(stderr, "Daemon socket failed\n");
             break;
 
         default:
@@ -389,6 +475,11 @@ int main(int argc, char *argv[]) {
     client.Cleanupsocket();
     sgx_destroy_enclave(enclave_id);
 
+    if (AIBE_STATS) {
+        aibe_stats_t st;
+        aibe_stats(&st);
+        aibe_stats_print(OUTPUT, &st);
+    }
     aibeAlgo.clear();
     fprintf(OUTPUT, "Success Clean Up A-IBE \n");
 
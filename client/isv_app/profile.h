@@ -0,0 +1,111 @@
+//
+// Benchmark of the A-IBE operations under the param files in param_dir
+//
+
+#ifndef PBC_TEST_PROFILE_H
+#define PBC_TEST_PROFILE_H
+
+#include "aibe.h"
+#include <dirent.h>
+#include <chrono>
+#include <string>
+#include <algorithm>
+
+#define PROFILE_ITER 20
+
+typedef struct profile_t {
+    char name[64];
+    double keygen1, keygen2, keygen3, encrypt, decrypt; // ops/s
+    int size_block, size_ct_block, size_dk, size_mpk; // bytes
+} profile_t;
+
+template<typename F>
+double profile_rate(F fn, int iter);
+
+int profile_bench(profile_t *prof, const char *name, int iter);
+
+int profile_bench_all(FILE *out, int iter);
+
+
+template<typename F>
+double profile_rate(F fn, int iter) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iter; ++i) {
+        fn();
+    }
+    std::chrono::duration<double> sec = std::chrono::steady_clock::now() - start;
+    return iter / sec.count();
+}
+
+// Runs every operation iter times on fresh in-memory master keys, nothing is written to param_dir.
+// Returns -1 if the profile cannot be loaded (missing or asymmetric) or a derived key fails.
+int profile_bench(profile_t *prof, const char *name, int iter) {
+    int ret = 0;
+    AibeAlgo aibe;
+    aibe_id_t id;
+
+    memset(prof, 0, sizeof(*prof));
+    snprintf(prof->name, sizeof(prof->name), "%s", name);
+    if (aibe.load_profile(name))
+        return -1;
+    aibe.init();
+    aibe.setup();
+    aibe.mpk_precompute();
+    id_hash(&id, ID);
+
+    prof->keygen1 = profile_rate([&]() { aibe.keygen1(&id); }, iter);
+    prof->keygen2 = profile_rate([&]() { aibe.keygen2(); }, iter);
+    if (aibe.keygen3()) {
+        ret = -1;
+        goto CLEANUP;
+    }
+    prof->keygen3 = profile_rate([&]() { aibe.keygen3(); }, iter);
+    aibe.dk_pp_init();
+
+    prof->encrypt = profile_rate([&]() {
+        element_random(aibe.blk.m);
+        aibe.block_encrypt(&aibe.blk, &id);
+    }, iter);
+    prof->decrypt = profile_rate([&]() { aibe.block_decrypt(&aibe.blk); }, iter);
+
+    prof->size_block = aibe.size_block;
+    prof->size_ct_block = aibe.size_ct_block;
+    prof->size_dk = aibe.size_comp_G1 * 2 + aibe.size_Zr;
+    prof->size_mpk = aibe.size_comp_G2 + aibe.size_comp_G1 * (3 + z_size);
+
+    CLEANUP:
+    aibe.clear();
+    return ret;
+}
+
+int profile_bench_all(FILE *out, int iter) {
+    std::vector<std::string> names;
+    struct dirent *ent;
+    DIR *dir = opendir(param_dir);
+    profile_t prof;
+
+    if (!dir)
+        return -1;
+    while ((ent = readdir(dir))) {
+        std::string fn(ent->d_name);
+        if (fn.size() > 6 && fn.compare(fn.size() - 6, 6, ".param") == 0)
+            names.push_back(fn.substr(0, fn.size() - 6));
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+
+    fprintf(out, "%-24s %10s %10s %10s %10s %10s %8s %8s %8s %8s\n", "profile", "keygen1/s", "keygen2/s",
+            "keygen3/s", "enc/s", "dec/s", "block", "ct", "dk", "mpk");
+    for (size_t i = 0; i < names.size(); ++i) {
+        if (profile_bench(&prof, names[i].c_str(), iter)) {
+            fprintf(out, "%-24s skipped: not loadable or not symmetric\n", names[i].c_str());
+            continue;
+        }
+        fprintf(out, "%-24s %10.1f %10.1f %10.1f %10.1f %10.1f %8d %8d %8d %8d\n", prof.name, prof.keygen1,
+                prof.keygen2, prof.keygen3, prof.encrypt, prof.decrypt, prof.size_block, prof.size_ct_block,
+                prof.size_dk, prof.size_mpk);
+    }
+    return 0;
+}
+
+#endif //PBC_TEST_PROFILE_H
@@ -357,8 +357,8 @@ int pkg_keygen(const ra_samp_request_header_t *p_msg,
 //    PRINT_BYTE_ARRAY(stdout, p_data, data_size);
 //    PRINT_BYTE_ARRAY(stdout, mac, SGX_AESGCM_MAC_SIZE);
 
-    element_from_bytes_compressed(aibeAlgo.R, out_data);
-    element_from_bytes_compressed(aibeAlgo.Hz, out_data + aibeAlgo.size_comp_G1);
+    elem_decompress(aibeAlgo.R, out_data);
+    elem_decompress(aibeAlgo.Hz, out_data + aibeAlgo.size_comp_G1);
 
     {
         fprintf(stdout, "\nData of Hz and R is\n");
@@ -531,12 +531,25 @@ int main(int argc, char *argv[]) {
     int buflen = 0;
     uint32_t extended_epid_group_id = 0;
 
-    aibeAlgo.load_param(param_path);
+    // before the first GMP / PBC allocation
+    alloc_install();
+    alloc_thread_begin();
+
+    if (aibeAlgo.load_profile(getenv("AIBE_PROFILE"))) {
+        fprintf(stderr, "\nParam File Path error");
+        return -1;
+    }
     puts("param loaded");
     aibeAlgo.init();
+    // the PKG serves keygen2 for many clients, keep its randomness precomputed
+    aibeAlgo.kg2_pool_cap = 32;
     puts("init");
-    aibeAlgo.mpk_load();
-    aibeAlgo.msk_load();
+    if (aibeAlgo.bundle_load(bundle_path, BUNDLE_MSK)) {
+        aibeAlgo.mpk_load();
+        aibeAlgo.msk_load();
+        if (aibeAlgo.bundle_store(bundle_path, BUNDLE_MSK | BUNDLE_TABLES))
+            fprintf(stderr, "Write %s failed\n", bundle_path);
+    }
     puts("mpk loaded");
 
 //    aibeAlgo.run(OUTPUT);
@@ -613,6 +626,12 @@ int main(int argc, char *argv[]) {
                 switch (p_req->type) {
                     case TYPE_EXIT:
                         fprintf(OUTPUT, "\nConnection terminated");
+                        if (AIBE_STATS) {
+                            aibe_stats_t st;
+                            aibe_stats(&st);
+                            fprintf(OUTPUT, "\n");
+                            aibe_stats_print(OUTPUT, &st);
+                        }
                         SAFE_FREE(p_req);
                         is_recv = false;
                         break;
@@ -0,0 +1,450 @@
+//
+// Type a pairing specialised for y^2 = x^3 + x over F_q, q = 3 mod 4, q < 2^512: fixed width
+// Montgomery arithmetic on 8 limbs, Miller loop over the NAF of r with the lines of the first
+// argument precomputable, final exponentiation (q^2 - 1) / r done as conj(f) / f followed by a
+// power of unitary elements. The symmetric pairing is the reduced Tate pairing e(P, phi(Q)),
+// phi(x, y) = (-x, iy), the same value PBC computes for type a params.
+//
+// Points and results travel as element_to_bytes() images: x | y and a | b (a + bi), each F_q
+// element len bytes big-endian.
+//
+
+#ifndef PBC_TEST_TPA_H
+#define PBC_TEST_TPA_H
+
+#include <gmp.h>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+#define TPA_LIMBS 8
+// pairs of one tpa_eval() that keep their coordinates on the stack
+#define TPA_EVAL_STACK 8
+
+typedef unsigned __int128 tpa_u128;
+
+// F_q element in Montgomery form, little-endian limbs, always < q
+typedef struct tpa_fp_t {
+    uint64_t v[TPA_LIMBS];
+} tpa_fp_t;
+
+// a + bi, i^2 = -1
+typedef struct tpa_fp2_t {
+    tpa_fp_t a, b;
+} tpa_fp2_t;
+
+// Miller line at phi(Q) = (-xq, i yq): (c0 + c1 * xq) + (c2 * yq) i, up to an F_q factor
+typedef struct tpa_line_t {
+    tpa_fp_t c0, c1, c2;
+} tpa_line_t;
+
+typedef struct tpa_t {
+    tpa_fp_t q; // plain
+    uint64_t qinv; // -q^-1 mod 2^64
+    tpa_fp_t r2; // 2^1024 mod q
+    tpa_fp_t one; // 2^512 mod q
+    tpa_fp_t qm2; // plain q - 2, the exponent of the inverse
+    int len; // bytes per F_q element
+    std::vector<int8_t> naf_r; // NAF of r, most significant digit first
+    std::vector<int8_t> naf_h; // NAF of (q + 1) / r
+    std::vector<uint8_t> dbl; // per Miller step: 1 doubling, 0 addition
+} tpa_t;
+
+// lines of e(P, .) for a fixed P, one per Miller step
+typedef struct tpa_pp_t {
+    std::vector<tpa_line_t> lines;
+} tpa_pp_t;
+
+int tpa_init(tpa_t *t, mpz_t q, mpz_t r, int len);
+
+void tpa_naf(std::vector<int8_t> *out, mpz_t e);
+
+void tpa_mul(const tpa_t *t, tpa_fp_t *out, const tpa_fp_t *x, const tpa_fp_t *y);
+
+void tpa_add(const tpa_t *t, tpa_fp_t *out, const tpa_fp_t *x, const tpa_fp_t *y);
+
+void tpa_sub(const tpa_t *t, tpa_fp_t *out, const tpa_fp_t *x, const tpa_fp_t *y);
+
+int tpa_is0(const tpa_fp_t *x);
+
+void tpa_inv(const tpa_t *t, tpa_fp_t *out, const tpa_fp_t *x);
+
+void tpa_from_bytes(const tpa_t *t, tpa_fp_t *out, const uint8_t *buf);
+
+void tpa_to_bytes(const tpa_t *t, uint8_t *buf, const tpa_fp_t *x);
+
+void tpa_fp2_mul(const tpa_t *t, tpa_fp2_t *out, const tpa_fp2_t *x, const tpa_fp2_t *y);
+
+void tpa_fp2_sqr(const tpa_t *t, tpa_fp2_t *out, const tpa_fp2_t *x);
+
+void tpa_pp_init(const tpa_t *t, tpa_pp_t *pp, const uint8_t *p);
+
+void tpa_eval(const tpa_t *t, uint8_t *out, tpa_pp_t **pp, uint8_t **q, int num);
+
+void tpa_final_exp(const tpa_t *t, tpa_fp2_t *f);
+
+
+void tpa_mpz_to_fp(tpa_fp_t *out, mpz_t z) {
+    memset(out->v, 0, sizeof(out->v));
+    mpz_export(out->v, NULL, -1, sizeof(uint64_t), 0, 0, z);
+}
+
+// Returns -1 unless q fits the 64-bit limbs; q = 3 mod 4 and r | q + 1 are the caller's type a checks.
+int tpa_init(tpa_t *t, mpz_t q, mpz_t r, int len) {
+    mpz_t z;
+    uint64_t inv = 1;
+
+    if (GMP_NUMB_BITS != 64 || mpz_sizeinbase(q, 2) > 64 * TPA_LIMBS || len > 8 * TPA_LIMBS ||
+        mpz_even_p(q))
+        return -1;
+    mpz_init(z);
+    t->len = len;
+    tpa_mpz_to_fp(&t->q, q);
+    // Newton iteration for q^-1 mod 2^64
+    for (int i = 0; i < 6; ++i) {
+        inv *= 2 - t->q.v[0] * inv;
+    }
+    t->qinv = -inv;
+
+    mpz_setbit(z, 64 * TPA_LIMBS);
+    mpz_mod(z, z, q);
+    tpa_mpz_to_fp(&t->one, z);
+    mpz_set_ui(z, 0);
+    mpz_setbit(z, 128 * TPA_LIMBS);
+    mpz_mod(z, z, q);
+    tpa_mpz_to_fp(&t->r2, z);
+    mpz_sub_ui(z, q, 2);
+    tpa_mpz_to_fp(&t->qm2, z);
+
+    tpa_naf(&t->naf_r, r);
+    mpz_add_ui(z, q, 1);
+    mpz_divexact(z, z, r);
+    tpa_naf(&t->naf_h, z);
+
+    t->dbl.clear();
+    for (size_t i = 1; i < t->naf_r.size(); ++i) {
+        t->dbl.push_back(1);
+        if (t->naf_r[i])
+            t->dbl.push_back(0);
+    }
+    mpz_clear(z);
+    return 0;
+}
+
+// non-adjacent form of e > 0, most significant digit first
+void tpa_naf(std::vector<int8_t> *out, mpz_t e) {
+    mpz_t k;
+
+    mpz_init_set(k, e);
+    out->clear();
+    while (mpz_sgn(k) > 0) {
+        int d = 0;
+        if (mpz_odd_p(k)) {
+            d = 2 - (int) mpz_fdiv_ui(k, 4);
+            if (d > 0) {
+                mpz_sub_ui(k, k, 1);
+            } else {
+                mpz_add_ui(k, k, 1);
+            }
+        }
+        out->push_back(d);
+        mpz_fdiv_q_2exp(k, k, 1);
+    }
+    std::reverse(out->begin(), out->end());
+    mpz_clear(k);
+}
+
+// x - q if x >= q, for x < 2q with the carry bit hi
+void tpa_reduce(const tpa_t *t, tpa_fp_t *x, uint64_t hi) {
+    uint64_t d[TPA_LIMBS];
+    uint64_t borrow = 0;
+
+    for (int i = 0; i < TPA_LIMBS; ++i) {
+        tpa_u128 s = (tpa_u128) x->v[i] - t->q.v[i] - borrow;
+        d[i] = (uint64_t) s;
+        borrow = (uint64_t) (s >> 64) & 1;
+    }
+    if (hi || !borrow)
+        memcpy(x->v, d, sizeof(d));
+}
+
+// Montgomery product out = x * y / 2^512 mod q: GMP's mpn product (or square), then one
+// mpn_addmul_1 per limb clears the low half
+void tpa_mul(const tpa_t *t, tpa_fp_t *out, const tpa_fp_t *x, const tpa_fp_t *y) {
+    mp_limb_t r[2 * TPA_LIMBS];
+    uint64_t hi = 0;
+
+    if (x == y) {
+        mpn_sqr(r, (const mp_limb_t *) x->v, TPA_LIMBS);
+    } else {
+        mpn_mul_n(r, (const mp_limb_t *) x->v, (const mp_limb_t *) y->v, TPA_LIMBS);
+    }
+    for (int i = 0; i < TPA_LIMBS; ++i) {
+        mp_limb_t c = mpn_addmul_1(r + i, (const mp_limb_t *) t->q.v, TPA_LIMBS, r[i] * t->qinv);
+        // the carry goes into limb i + TPA_LIMBS and up, past the top into hi
+        for (int k = i + TPA_LIMBS; c && k < 2 * TPA_LIMBS; ++k) {
+            r[k] += c;
+            c = r[k] < c;
+        }
+        hi += c;
+    }
+    memcpy(out->v, r + TPA_LIMBS, sizeof(out->v));
+    tpa_reduce(t, out, hi);
+}
+
+void tpa_add(const tpa_t *t, tpa_fp_t *out, const tpa_fp_t *x, const tpa_fp_t *y) {
+    uint64_t carry = 0;
+
+    for (int i = 0; i < TPA_LIMBS; ++i) {
+        tpa_u128 s = (tpa_u128) x->v[i] + y->v[i] + carry;
+        out->v[i] = (uint64_t) s;
+        carry = (uint64_t) (s >> 64);
+    }
+    tpa_reduce(t, out, carry);
+}
+
+void tpa_sub(const tpa_t *t, tpa_fp_t *out, const tpa_fp_t *x, const tpa_fp_t *y) {
+    uint64_t borrow = 0;
+
+    for (int i = 0; i < TPA_LIMBS; ++i) {
+        tpa_u128 s = (tpa_u128) x->v[i] - y->v[i] - borrow;
+        out->v[i] = (uint64_t) s;
+        borrow = (uint64_t) (s >> 64) & 1;
+    }
+    if (borrow) {
+        uint64_t carry = 0;
+        for (int i = 0; i < TPA_LIMBS; ++i) {
+            tpa_u128 s = (tpa_u128) out->v[i] + t->q.v[i] + carry;
+            out->v[i] = (uint64_t) s;
+            carry = (uint64_t) (s >> 64);
+        }
+    }
+}
+
+int tpa_is0(const tpa_fp_t *x) {
+    uint64_t acc = 0;
+
+    for (int i = 0; i < TPA_LIMBS; ++i) {
+        acc |= x->v[i];
+    }
+    return acc == 0;
+}
+
+// x^(q - 2); only the final exponentiation inverts
+void tpa_inv(const tpa_t *t, tpa_fp_t *out, const tpa_fp_t *x) {
+    tpa_fp_t acc = t->one;
+
+    for (int i = 64 * TPA_LIMBS - 1; i >= 0; --i) {
+        tpa_mul(t, &acc, &acc, &acc);
+        if ((t->qm2.v[i / 64] >> (i % 64)) & 1)
+            tpa_mul(t, &acc, &acc, x);
+    }
+    *out = acc;
+}
+
+void tpa_from_bytes(const tpa_t *t, tpa_fp_t *out, const uint8_t *buf) {
+    tpa_fp_t x;
+
+    memset(x.v, 0, sizeof(x.v));
+    for (int i = 0; i < t->len; ++i) {
+        int k = t->len - 1 - i;
+        x.v[k / 8] |= (uint64_t) buf[i] << (8 * (k % 8));
+    }
+    tpa_mul(t, out, &x, &t->r2);
+}
+
+void tpa_to_bytes(const tpa_t *t, uint8_t *buf, const tpa_fp_t *x) {
+    tpa_fp_t one, y;
+
+    memset(one.v, 0, sizeof(one.v));
+    one.v[0] = 1;
+    tpa_mul(t, &y, x, &one);
+    for (int i = 0; i < t->len; ++i) {
+        int k = t->len - 1 - i;
+        buf[i] = (uint8_t) (y.v[k / 8] >> (8 * (k % 8)));
+    }
+}
+
+// (a + bi)(c + di) = (ac - bd) + ((a + b)(c + d) - ac - bd) i
+void tpa_fp2_mul(const tpa_t *t, tpa_fp2_t *out, const tpa_fp2_t *x, const tpa_fp2_t *y) {
+    tpa_fp_t ac, bd, s1, s2;
+
+    tpa_mul(t, &ac, &x->a, &y->a);
+    tpa_mul(t, &bd, &x->b, &y->b);
+    tpa_add(t, &s1, &x->a, &x->b);
+    tpa_add(t, &s2, &y->a, &y->b);
+    tpa_mul(t, &s1, &s1, &s2);
+    tpa_sub(t, &out->a, &ac, &bd);
+    tpa_sub(t, &s1, &s1, &ac);
+    tpa_sub(t, &out->b, &s1, &bd);
+}
+
+// (a + bi)^2 = (a + b)(a - b) + 2ab i
+void tpa_fp2_sqr(const tpa_t *t, tpa_fp2_t *out, const tpa_fp2_t *x) {
+    tpa_fp_t s, d, ab;
+
+    tpa_add(t, &s, &x->a, &x->b);
+    tpa_sub(t, &d, &x->a, &x->b);
+    tpa_mul(t, &ab, &x->a, &x->b);
+    tpa_mul(t, &out->a, &s, &d);
+    tpa_add(t, &out->b, &ab, &ab);
+}
+
+// Lines of the Miller loop of P = x | y (not infinity) with T in Jacobian coordinates. Vertical
+// lines are F_q valued and vanish in the final exponentiation, so the last addition, which
+// reaches T = -P, stores the constant line 1.
+void tpa_pp_init(const tpa_t *t, tpa_pp_t *pp, const uint8_t *p) {
+    tpa_fp_t xp, yp, yn, X, Y, Z;
+    tpa_fp_t y2, s, z2, m, u, v, h, rr, z3;
+    tpa_line_t *l;
+    size_t n = 0;
+
+    tpa_from_bytes(t, &xp, p);
+    tpa_from_bytes(t, &yp, p + t->len);
+    memset(yn.v, 0, sizeof(yn.v));
+    tpa_sub(t, &yn, &yn, &yp);
+    X = xp;
+    Y = yp;
+    Z = t->one;
+    pp->lines.resize(t->dbl.size());
+
+    for (size_t i = 1; i < t->naf_r.size(); ++i) {
+        // tangent: c0 = M X - 2 Y^2, c1 = M Z^2, c2 = Z3 Z^2 with M = 3 X^2 + Z^4, Z3 = 2 Y Z
+        l = &pp->lines[n++];
+        tpa_mul(t, &y2, &Y, &Y);
+        tpa_mul(t, &z2, &Z, &Z);
+        tpa_mul(t, &m, &X, &X);
+        tpa_add(t, &u, &m, &m);
+        tpa_add(t, &m, &m, &u);
+        tpa_mul(t, &u, &z2, &z2);
+        tpa_add(t, &m, &m, &u);
+        tpa_add(t, &z3, &Y, &Y);
+        tpa_mul(t, &z3, &z3, &Z);
+        tpa_mul(t, &l->c0, &m, &X);
+        tpa_add(t, &u, &y2, &y2);
+        tpa_sub(t, &l->c0, &l->c0, &u);
+        tpa_mul(t, &l->c1, &m, &z2);
+        tpa_mul(t, &l->c2, &z3, &z2);
+        // 2T: S = 4 X Y^2, X3 = M^2 - 2S, Y3 = M (S - X3) - 8 Y^4
+        tpa_mul(t, &s, &X, &y2);
+        tpa_add(t, &s, &s, &s);
+        tpa_add(t, &s, &s, &s);
+        tpa_mul(t, &X, &m, &m);
+        tpa_sub(t, &X, &X, &s);
+        tpa_sub(t, &X, &X, &s);
+        tpa_sub(t, &u, &s, &X);
+        tpa_mul(t, &u, &m, &u);
+        tpa_mul(t, &v, &y2, &y2);
+        tpa_add(t, &v, &v, &v);
+        tpa_add(t, &v, &v, &v);
+        tpa_add(t, &v, &v, &v);
+        tpa_sub(t, &Y, &u, &v);
+        Z = z3;
+
+        if (!t->naf_r[i])
+            continue;
+        // chord through T and +-P: c0 = R xp - Z3 yp, c1 = R, c2 = Z3 with
+        // H = xp Z^2 - X, R = yp Z^3 - Y, Z3 = Z H
+        const tpa_fp_t *py = t->naf_r[i] > 0 ? &yp : &yn;
+        l = &pp->lines[n++];
+        tpa_mul(t, &z2, &Z, &Z);
+        tpa_mul(t, &h, &xp, &z2);
+        tpa_sub(t, &h, &h, &X);
+        if (tpa_is0(&h)) {
+            memset(l, 0, sizeof(*l));
+            l->c0 = t->one;
+            continue;
+        }
+        tpa_mul(t, &rr, &z2, &Z);
+        tpa_mul(t, &rr, &rr, py);
+        tpa_sub(t, &rr, &rr, &Y);
+        tpa_mul(t, &z3, &Z, &h);
+        tpa_mul(t, &l->c0, &rr, &xp);
+        tpa_mul(t, &u, &z3, py);
+        tpa_sub(t, &l->c0, &l->c0, &u);
+        l->c1 = rr;
+        l->c2 = z3;
+        // T + P: X3 = R^2 - H^3 - 2 X H^2, Y3 = R (X H^2 - X3) - Y H^3
+        tpa_mul(t, &u, &h, &h);
+        tpa_mul(t, &v, &u, &h);
+        tpa_mul(t, &u, &X, &u);
+        tpa_mul(t, &X, &rr, &rr);
+        tpa_sub(t, &X, &X, &v);
+        tpa_sub(t, &X, &X, &u);
+        tpa_sub(t, &X, &X, &u);
+        tpa_sub(t, &u, &u, &X);
+        tpa_mul(t, &u, &rr, &u);
+        tpa_mul(t, &v, &Y, &v);
+        tpa_sub(t, &Y, &u, &v);
+        Z = z3;
+    }
+}
+
+// f^((q^2 - 1) / r): f^(q - 1) = conj(f) / f = conj(f)^2 / (a^2 + b^2) is unitary, so the power
+// by (q + 1) / r takes conj() for the negative NAF digits
+void tpa_final_exp(const tpa_t *t, tpa_fp2_t *f) {
+    tpa_fp_t n, u;
+    tpa_fp2_t g, gc, acc;
+
+    tpa_mul(t, &n, &f->a, &f->a);
+    tpa_mul(t, &u, &f->b, &f->b);
+    tpa_add(t, &n, &n, &u);
+    tpa_inv(t, &n, &n);
+    g.a = f->a;
+    memset(g.b.v, 0, sizeof(g.b.v));
+    tpa_sub(t, &g.b, &g.b, &f->b);
+    tpa_fp2_sqr(t, &g, &g);
+    tpa_mul(t, &g.a, &g.a, &n);
+    tpa_mul(t, &g.b, &g.b, &n);
+
+    gc.a = g.a;
+    memset(gc.b.v, 0, sizeof(gc.b.v));
+    tpa_sub(t, &gc.b, &gc.b, &g.b);
+    acc = g;
+    for (size_t i = 1; i < t->naf_h.size(); ++i) {
+        tpa_fp2_sqr(t, &acc, &acc);
+        if (t->naf_h[i] > 0)
+            tpa_fp2_mul(t, &acc, &acc, &g);
+        else if (t->naf_h[i] < 0)
+            tpa_fp2_mul(t, &acc, &acc, &gc);
+    }
+    *f = acc;
+}
+
+// out = prod e(P_j, Q_j) for j < num, P_j given by its lines, Q_j = x | y not infinity; one
+// shared squaring per doubling step and a single final exponentiation
+void tpa_eval(const tpa_t *t, uint8_t *out, tpa_pp_t **pp, uint8_t **q, int num) {
+    tpa_fp2_t f, l;
+    tpa_fp_t stack[2 * TPA_EVAL_STACK];
+    std::vector<tpa_fp_t> heap;
+    tpa_fp_t *xq = stack, *yq;
+
+    if (num > TPA_EVAL_STACK) {
+        heap.resize(2 * num);
+        xq = heap.data();
+    }
+    yq = xq + num;
+    for (int j = 0; j < num; ++j) {
+        tpa_from_bytes(t, &xq[j], q[j]);
+        tpa_from_bytes(t, &yq[j], q[j] + t->len);
+    }
+    f.a = t->one;
+    memset(f.b.v, 0, sizeof(f.b.v));
+    for (size_t s = 0; s < t->dbl.size(); ++s) {
+        if (t->dbl[s])
+            tpa_fp2_sqr(t, &f, &f);
+        for (int j = 0; j < num; ++j) {
+            const tpa_line_t *ln = &pp[j]->lines[s];
+            tpa_mul(t, &l.a, &ln->c1, &xq[j]);
+            tpa_add(t, &l.a, &l.a, &ln->c0);
+            tpa_mul(t, &l.b, &ln->c2, &yq[j]);
+            tpa_fp2_mul(t, &f, &f, &l);
+        }
+    }
+    tpa_final_exp(t, &f);
+    tpa_to_bytes(t, out, &f.a);
+    tpa_to_bytes(t, out + t->len, &f.b);
+}
+
+#endif //PBC_TEST_TPA_H